@@ -2,6 +2,12 @@
 // --------------------------------------------------------------------
 // Module:      sdspi.v
 // Description: Wishbone Compatible SPI core.
+//
+// Port 0x100 (byte)  : shift one byte out/in, /CS unchanged
+// Port 0x100 (word)  : byte mode: bit 8 = /CS, low byte shifted out
+//                      word mode: two bytes shifted, low byte first
+// Port 0x101 (byte)  : control, no SPI clocks: bit 0 = /CS,
+//                      bit 1 = word mode (16 bits per word access)
 // --------------------------------------------------------------------
 // --------------------------------------------------------------------
 module sdspi (
@@ -11,8 +17,8 @@ module sdspi (
     output reg 			ss,
     input            	wb_clk_i,	// Wishbone slave interface
     input            	wb_rst_i,
-    input      [8:0] 	wb_dat_i,
-    output reg [7:0] 	wb_dat_o,
+    input     [15:0] 	wb_dat_i,
+    output    [15:0] 	wb_dat_o,
     input            	wb_we_i,
     input      [1:0] 	wb_sel_i,
     input            	wb_stb_i,
@@ -22,42 +28,50 @@ module sdspi (
 
   // Registers and nets
   wire       op;
+  wire       ctl;
   wire       start;
   wire       send;
-  reg  [7:0] tr;
+  reg [15:0] tr;
   reg        st;
-  reg  [7:0] sft;
+  reg [15:0] sft;
+  reg [15:0] rx;
   reg  [1:0] clk_div;
+  reg        wide;
 
   // Continuous assignments
-  assign op     = wb_stb_i & wb_cyc_i;
+  assign ctl    = wb_stb_i & wb_cyc_i & wb_we_i & (wb_sel_i == 2'b10);
+  assign op     = wb_stb_i & wb_cyc_i & !ctl;
   assign start  = !st & op;
   assign send   = start & wb_we_i & wb_sel_i[0];
 
+  // In word mode the first byte on the wire is the low byte
+  assign wb_dat_o = wide ? { rx[7:0], rx[15:8] } : { 8'h00, rx[7:0] };
+
   // Behaviour
   // mosi
   always @(posedge wb_clk_i)
-    mosi <= wb_rst_i ? 1'b1 : (clk_div==2'b10 ? (send ? wb_dat_i[7] : tr[7]) : mosi);
+    mosi <= wb_rst_i ? 1'b1 : (clk_div==2'b10 ? (send ? wb_dat_i[7] : tr[15]) : mosi);
 
   // tr
   always @(posedge wb_clk_i)
-    tr <= wb_rst_i ? 8'hff : (clk_div==2'b10 ? { (send ? wb_dat_i[6:0] : tr[6:0]), 1'b1 } : tr);
+    tr <= wb_rst_i ? 16'hffff : (clk_div==2'b10 ? (send ? { wb_dat_i[6:0], (wide ? wb_dat_i[15:8] : 8'hff), 1'b1 }
+                                                        : { tr[14:0], 1'b1 }) : tr);
 
   // wb_ack_o
   always @(posedge wb_clk_i)
-    wb_ack_o <= wb_rst_i ? 1'b0 : (wb_ack_o ? 1'b0 : (sft[0] && clk_div==2'b00));
+    wb_ack_o <= wb_rst_i ? 1'b0 : (wb_ack_o ? 1'b0 : (ctl || (sft[0] && clk_div==2'b00)));
 
-  // sft
+  // sft: one bit per SPI clock, 8 in byte mode and 16 in word mode
   always @(posedge wb_clk_i)
-    sft <= wb_rst_i ? 8'h0 : (clk_div==2'b10 ? { start, sft[7:1] } : sft);
+    sft <= wb_rst_i ? 16'h0 : (clk_div==2'b10 ? { start & wide, sft[15:9], sft[8] | (start & !wide), sft[7:1] } : sft);
 
   // st
   always @(posedge wb_clk_i)
     st <= wb_rst_i ? 1'b0 : (st ? !sft[0] : op && clk_div==2'b10);
 
-  // wb_dat_o
+  // rx
   always @(posedge wb_clk_i)
-    wb_dat_o <= wb_rst_i ? 8'h0 : ((op && clk_div==2'b0) ? { wb_dat_o[6:0], miso } : wb_dat_o);
+    rx <= wb_rst_i ? 16'h0 : ((op && clk_div==2'b0) ? { rx[14:0], miso } : rx);
 
   // sclk
   always @(posedge wb_clk_i)
@@ -65,9 +79,13 @@ module sdspi (
 
   // ss
   always @(negedge wb_clk_i)
-    ss <= wb_rst_i ? 1'b1 : ((op & wb_we_i & wb_sel_i[1]) ? wb_dat_i[8] : ss);
+    ss <= wb_rst_i ? 1'b1 : ((ctl || (op & wb_we_i & wb_sel_i[1] & !wide)) ? wb_dat_i[8] : ss);
+
+  // wide
+  always @(posedge wb_clk_i)
+    wide <= wb_rst_i ? 1'b0 : (ctl ? wb_dat_i[9] : wide);
 
   // clk_div
   always @(posedge wb_clk_i) clk_div <= clk_div - 2'd1;
-  
+
 endmodule
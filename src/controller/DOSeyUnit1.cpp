@@ -321,6 +321,14 @@ void __fastcall TForm1::ConfigFPGABitBtn1Click(TObject *Sender)
     TMemoryStream *rbf = new TMemoryStream();
     rbf->LoadFromFile(FGPARBFText1->Caption);
 
+    TMemoryStream *packed = new TMemoryStream();
+    byte command = 0x10;                // Start config Command
+    if(FlashTestForm1->CompressRBF(rbf, packed)) {
+        rbf->LoadFromStream(packed);    // Fewer reports, the PIC expands it
+        command = 0x12;                 // Start compressed config Command
+    }
+    delete packed;
+
     LoggerForm1->StartMonButton1Click(Sender);
 
     if(MyHidDev == NULL) {
@@ -345,7 +353,7 @@ void __fastcall TForm1::ConfigFPGABitBtn1Click(TObject *Sender)
 
         for(int t = 0; t < 64; t++) Report[t] = 0; // clear out the buffer
         Report[0] = 0;
-        Report[1] = 0x10;                 // Start config Command
+        Report[1] = command;              // Start config Command
         Report[2] = byte(Blocks >>   8);  // Start config Command
         Report[3] = byte(Blocks & 0xFF);  // Start config Command
         Report[4] = byte(remainder);      // Start config Command
@@ -61,6 +61,10 @@
 //    0x0F    0x11    3 End   address of RBF File
 //
 //    0x12    0x12    1 Boot type, 0= No boot (debug), 1=HD, 2= Floppy, 
+//    0x13    0x13    1 RBF format, 1= RLE compressed, anything else raw
+//
+// The RBF End address is one past the last stored byte (Start + size) for
+// both formats, the PIC streams End - Start bytes to the FPGA.
 //------------------------------------------------------------------------------
 #define EEPROM_S_ADDR_BIOS   0x00  // Start address of Bios File pointer in EEPROM
 #define EEPROM_E_ADDR_BIOS   0x03  // End   address of Bios File pointer in EEPROM
@@ -68,6 +72,9 @@
 #define EEPROM_E_ADDR_FLOPPY 0x09  // End   address of Floppy File pointer in EEPROM
 #define EEPROM_S_ADDR_RBF    0x0C  // Start address of RBF File pointer in EEPROM
 #define EEPROM_E_ADDR_RBF    0x0F  // End   address of RBF File pointer in EEPROM
+#define EEPROM_RBF_FORMAT    0x13  // RBF format indicator in EEPROM, End is exclusive for both
+#define RBF_RAW              0x00  // RBF is stored as is
+#define RBF_RLE              0x01  // RBF is stored RLE compressed
 
 //---------------------------------------------------------------------------
 
@@ -476,6 +483,48 @@ bool __fastcall TFlashTestForm1::Write64Bytes(int Address)
 //---------------------------------------------------------------------------
 // Check for Blank Block
 //---------------------------------------------------------------------------
+// Write size bytes from src to the Flash at Address as one stream: a single
+// 0x97 command, then back to back data reports with no per block handshake.
+// The last report is padded with 0xFF, the PIC skips reports that are blank.
+//---------------------------------------------------------------------------
+bool __fastcall TFlashTestForm1::WriteBlocks(int Address, TStream *src, int size)
+{
+    bool ret = false;
+    int  numBlocks = (size + ReportSize - 1) / ReportSize;
+    if(Form1->MyHidDev->OpenFile()) {
+        Form1->StatusBar1->Panels->Items[0]->Text = "Connected";
+        LoggerForm1->HidLoggerMemo1->Lines->Add("Connected.");
+        memset(Report, 0, sizeof(Report));
+        Report[0] = 0;
+        Report[1] = 0x97;
+        Report[2] = (Address >> 24) & 0xFF;
+        Report[3] = (Address >> 16) & 0xFF;
+        Report[4] = (Address >>  8) & 0xFF;
+        Report[5] = (Address      ) & 0xFF;
+        Report[6] = (numBlocks >> 8) & 0xFF;
+        Report[7] = (numBlocks     ) & 0xFF;
+
+        unsigned BytesWritten;
+        ret = Form1->MyHidDev->WriteFile(Report, ReportSize+1, BytesWritten);
+        if(ret) STDialogMemo1->Lines->Add("Stream Write Command sent");
+        else    STDialogMemo1->Lines->Add("Writereport error, " + SysErrorMessage(GetLastError()));
+
+        for(int i = 0; ret && i < numBlocks; i++) {
+            memset(Report, 0xFF, sizeof(Report));
+            Report[0] = 0;
+            src->Read(&Report[1], ReportSize);
+            ret = Form1->MyHidDev->WriteFile(Report, ReportSize+1, BytesWritten);
+            if(!ret) STDialogMemo1->Lines->Add("Writereport error, " + SysErrorMessage(GetLastError()));
+            Form1->UpdateProgress(true, float(i)/float(numBlocks) * 100);
+        }
+        Form1->MyHidDev->CloseFile();
+        Form1->StatusBar1->Panels->Items[0]->Text = "Not Connected";
+        STDialogMemo1->Lines->Add("Disconnected.");
+    }
+    if(ret) ReadReport();
+    return(ret);
+}
+//---------------------------------------------------------------------------
 bool __fastcall TFlashTestForm1::CheckNotBlank(void)
 {
     bool ret = false;
@@ -569,17 +618,7 @@ void __fastcall TFlashTestForm1::UploadBIOStoFlash(void)
     //-----------------------------------------------------------------------
     Form1->ProgressMsg =  "Uploading BIOS";
     Form1->UpdateProgress(true, 0);
-    Address = FLASH_S_1_BIOS;
-    int numBlocks = filesize / ReportSize;
-    for(int i = 0; i < numBlocks; i++) {
-        rom->Read(Buffer, ReportSize);
-        if(CheckNotBlank()) {
-            ret = Write64Bytes(Address);
-            if(!ret) break;
-        }
-        Address += ReportSize;
-        Form1->UpdateProgress(true, float(i)/float(numBlocks) * 100);
-    }
+    ret = WriteBlocks(FLASH_S_1_BIOS, rom, filesize);
     Form1->UpdateProgress(false, 0);
 
     //-----------------------------------------------------------------------
@@ -621,6 +660,64 @@ void __fastcall TFlashTestForm1::UploadBIOStoFlash(void)
 }
 //---------------------------------------------------------------------------
 
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+// RLE compress an RBF for the PIC to expand while it configures the FPGA,
+// must match the decoders in HIDZet1.h. The output is a stream of:
+//
+//   Header    Follows  Description
+//   --------- -------- --------------------------------------------------------
+//   0nnnnnnn  n+1 data Literal, the n+1 bytes go to the FPGA as they are
+//   1nnnnnnn  lo, v    Run, byte v repeated ((n << 8) | lo) + 1 times
+//
+// Runs shorter than RLE_MIN_RUN stay in the literals, they would not save
+// anything. Returns true if the result is smaller than the original.
+//---------------------------------------------------------------------------
+#define RLE_RUN      0x80           // Header bit set for a run
+#define RLE_MAX_LIT  0x80           // Longest literal record
+#define RLE_MAX_RUN  0x8000         // Longest run record
+#define RLE_MIN_RUN  4              // Shortest run worth a record
+//---------------------------------------------------------------------------
+bool __fastcall TFlashTestForm1::CompressRBF(TMemoryStream *in, TMemoryStream *out)
+{
+    byte *src  = (byte *)in->Memory;
+    int   size = int(in->Size);
+    int   lit  = 0;                 // Start of the pending literal bytes
+    int   i    = 0;
+    byte  rec[3];
+
+    out->Clear();
+    for(;;) {
+        int run = 0;
+        if(i < size) {
+            run = 1;
+            while(i+run < size && run < RLE_MAX_RUN && src[i+run] == src[i]) run++;
+            if(run < RLE_MIN_RUN) {     // Too short, carry on with the literal
+                i += run;
+                continue;
+            }
+        }
+        while(lit < i) {                // Flush the literal ahead of the run
+            int n = i - lit;
+            if(n > RLE_MAX_LIT) n = RLE_MAX_LIT;
+            rec[0] = byte(n - 1);
+            out->Write(rec, 1);
+            out->Write(src + lit, n);
+            lit += n;
+        }
+        if(i >= size) break;
+        rec[0] = byte(RLE_RUN | ((run - 1) >> 8));
+        rec[1] = byte((run - 1) & 0xFF);
+        rec[2] = src[i];
+        out->Write(rec, 3);
+        i  += run;
+        lit = i;
+    }
+    out->Position = 0;
+    return out->Size < in->Size;
+}
+//---------------------------------------------------------------------------
+
 //---------------------------------------------------------------------------
 //---------------------------------------------------------------------------
 // Write RBF  To Flash Ram
@@ -647,6 +744,16 @@ void __fastcall TFlashTestForm1::UploadRBFtoFlash(void)
     //-----------------------------------------------------------------------
     TMemoryStream *rbf = new TMemoryStream();
     rbf->LoadFromFile(Form1->FGPARBFText1->Caption);
+
+    TMemoryStream *packed = new TMemoryStream();
+    byte format = RBF_RAW;
+    if(CompressRBF(rbf, packed)) {      // Store it compressed if that is smaller
+        STDialogMemo1->Lines->Add("RBF compressed from " + AnsiString(int(rbf->Size)) + " to " + AnsiString(int(packed->Size)) + " bytes");
+        rbf->LoadFromStream(packed);
+        format = RBF_RLE;
+    }
+    delete packed;
+
     int filesize = rbf->Size;
     if(filesize > FLASH_SZ_RBF) {
         STDialogMemo1->Lines->Add("RBF File too large for allocated space, expand space");
@@ -696,20 +803,7 @@ void __fastcall TFlashTestForm1::UploadRBFtoFlash(void)
     //-----------------------------------------------------------------------
     Form1->ProgressMsg =  "Uploading and Programming RBF";
     Form1->UpdateProgress(true, 0);
-    Address = FLASH_S_1_RBF;                        // Starting address
-    int numBlocks = filesize/ReportSize;
-    int remainder = filesize - (numBlocks*ReportSize);
-    for(int i = 0; i < numBlocks; i++) {
-        rbf->Read(Buffer, ReportSize);
-        ret = Write64Bytes(Address);
-        if(!ret) break;
-        Address += ReportSize;
-        Form1->UpdateProgress(true, float(i)/float(numBlocks) * 100);
-    }
-    if(remainder) {             // If there is a remainder (almost always)
-        rbf->Read(Buffer, remainder);
-        ret = Write64Bytes(Address);
-    }
+    ret = WriteBlocks(FLASH_S_1_RBF, rbf, filesize);
     Form1->UpdateProgress(false, 0);
 
     //-----------------------------------------------------------------------
@@ -736,6 +830,8 @@ void __fastcall TFlashTestForm1::UploadRBFtoFlash(void)
     FPGASPIForm1->WriteEE(EE_address++, ((end   >>  8) & 0xFF));
     FPGASPIForm1->WriteEE(EE_address  , ((end        ) & 0xFF));
 
+    FPGASPIForm1->WriteEE(EEPROM_RBF_FORMAT, format);
+
     //-----------------------------------------------------------------------
     StopMon();
 
@@ -831,22 +927,7 @@ void __fastcall TFlashTestForm1::UploadIMGtoFlash(void)
     //-----------------------------------------------------------------------
     Form1->ProgressMsg =  "Uploading IMG";
     Form1->UpdateProgress(true, 0);
-    Address = FLASH_S_1_FLOPPY;                        // Starting address
-    int numBlocks = filesize/ReportSize;
-    int remainder = filesize - (numBlocks*ReportSize);
-    for(int i = 0; i < numBlocks; i++) {
-        img->Read(Buffer, ReportSize);
-        if(CheckNotBlank()) {
-            ret = Write64Bytes(Address);
-            if(!ret) break;
-        }
-        Address += ReportSize;
-        Form1->UpdateProgress(true, float(i)/float(numBlocks) * 100);
-    }
-    if(remainder) {             // If there is a remainder (almost always)
-        img->Read(Buffer, remainder);
-        ret = Write64Bytes(Address);
-    }
+    ret = WriteBlocks(FLASH_S_1_FLOPPY, img, filesize);
     Form1->UpdateProgress(false, 0);
 
     //-----------------------------------------------------------------------
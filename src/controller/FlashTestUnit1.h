@@ -65,7 +65,9 @@ public:		// User declarations
     bool __fastcall EnableWriting(void);
     bool __fastcall Erase64KSector(int Address);
     bool __fastcall Write64Bytes(int Address);
+    bool __fastcall WriteBlocks(int Address, TStream *src, int size);
     bool __fastcall CheckNotBlank(void);
+    bool __fastcall CompressRBF(TMemoryStream *in, TMemoryStream *out);
 
     void __fastcall UploadBIOStoFlash(void);
     void __fastcall UploadRBFtoFlash(void);
@@ -38,6 +38,14 @@
 #define USB_REPORT_SIZE_TX          USB_REPORT_SIZE_RX 
 #define USB_MAX_EP0_PACKET_LENGTH   64
 
+//------------------------------------------------------------------------------
+// Transfers stay on the HID interrupt pair with 64 byte reports, polled every
+// 1 ms (USBdescHIDTest.h), flash uploads stream with command 0x97. There is no
+// bulk EP2 pair: the host reaches the board only through the HID class
+// driver (JvHidDeviceController), a vendor bulk interface would also need a
+// WinUSB driver and a second host transport.
+//------------------------------------------------------------------------------
+
 //------------------------------------------------------------------------------
 // the following defines needed for the CCS USB PIC driver to enable the TX endpoint 1
 // and allocate buffer space on the peripheral
@@ -178,14 +186,20 @@ int   spi_buffer[32];       // 16 byte buffer for SPI message from FPGA
 //    0x0F    0x11    3 End   address of RBF File
 //
 //    0x12    0x12    1 Boot type, 0= No boot (debug), 1=HD, 2= Floppy, 
+//    0x13    0x13    1 RBF format, 1= RLE compressed, anything else raw
+//
+// The RBF End address is one past the last stored byte (Start + size) for
+// both formats, as written by the host.
 //------------------------------------------------------------------------------
 #define S_ADDR_BIOS   0x00      // Start address of Bios File 
 #define E_ADDR_BIOS   0x03      // End   address of Bios File
 #define S_ADDR_FLOPPY 0x06      // Start address of Floppy File
 #define E_ADDR_FLOPPY 0x09      // End   address of Floppy File
 #define S_ADDR_RBF    0x0C      // Start address of RBF File
-#define E_ADDR_RBF    0x0F      // End   address of RBF File 
+#define E_ADDR_RBF    0x0F      // End   address of RBF File, exclusive
 #define BOOT_TYPE     0x12      // Boot type indicator
+#define RBF_FORMAT    0x13      // RBF format indicator
+#define RBF_RLE       0x01      // RBF is stored RLE compressed
 
 //------------------------------------------------------------------------------
 void Get_EEPROM(int address)
@@ -223,6 +237,12 @@ int32 get_ee_24(int address)
 #define FPGAclk     7               // FPGA clock ( pin  75)
 #define FPGA_SIO    IOPORT,FPGAsio  // FPGA SIO line LO=reset HI=active
 #define FPGA_CLK    IOPORT,FPGAclk  // FPGA clock line
+// #define FPGAcd   3               // FPGA CONF_DONE, un-comment once wired to RB3
+#ifdef FPGAcd
+#byte FPGA_PORT   = IOPORT          // FPGA upload port
+#bit  FPGA_CDONE  = FPGA_PORT.FPGAcd // FPGA CONF_DONE line, HI=configured
+#endif
+#define FPGA_INIT_BYTES 64          // Extra bytes clocked after CONF_DONE for init
 //--------------------------------------------------------------------------
 void LoadFPGAByte(byte Sdata)
 {
@@ -252,6 +272,29 @@ void LoadFPGAByte(byte Sdata)
     }
 #endif
 }
+
+//------------------------------------------------------------------------------
+void LoadFPGARun(byte Sdata, int16 Count)
+{
+    do {
+        LoadFPGAByte(Sdata);
+    } while(--Count);
+}
+
+//------------------------------------------------------------------------------
+// Compressed RBF, written by the DOSey host tool when it comes out smaller.
+// Bitstreams are mostly long runs of 0x00 or 0xFF, so it is a stream of:
+//
+//   Header    Follows  Description
+//   --------- -------- --------------------------------------------------------
+//   0nnnnnnn  n+1 data Literal, the n+1 bytes go to the FPGA as they are
+//   1nnnnnnn  lo, v    Run, byte v repeated ((n << 8) | lo) + 1 times
+//------------------------------------------------------------------------------
+#define RLE_RUN     0x80            // Header bit set for a run
+#define RLE_CTL     0               // Decoder expects a header
+#define RLE_LIT     1               // Decoder is copying literal bytes
+#define RLE_LEN     2               // Decoder expects the run length low byte
+#define RLE_VALUE   3               // Decoder expects the run value
 //------------------------------------------------------------------------------
 
 
@@ -333,12 +376,7 @@ void Get_ID(void)
     int   Buffer[blksize];          // Buffer for data 
     
     Buffer[0] = 'J';
-    output_low(FLASH_SELECT);            // Enable select line
-    STFlash_SendByte(0x9F);              // Send JDEC command
-    Buffer[1] = STFlash_GetByte();       // Get the ID;
-    Buffer[2] = STFlash_GetByte();       // Get the ID; 
-    Buffer[3] = STFlash_GetByte();       // Get the ID; 
-    output_high(FLASH_SELECT);           // Disable select line
+    STFlash_ReadID(&Buffer[1]);          // Get the ID;
     usb_put_packet(1, Buffer, blksize ,USB_DTS_TOGGLE);
 }
 
@@ -365,6 +403,29 @@ void Write_Flash(int32 Address)
     usb_put_packet(1, Buffer, blksize ,USB_DTS_TOGGLE);
 }
 
+//--------------------------------------------------------------------------
+//    Write Blks reports to Flash, one acknowledge when they are all done.
+//    The flash is erased first, so blank reports are not programmed.
+//--------------------------------------------------------------------------
+void Stream_Flash(int32 Address, int16 Blks) 
+{
+    int   Buffer[blksize];          // Buffer for data 
+    int   i, Blank;
+    int16 n;
+    for(n = 0; n < Blks; n++) {
+        while(!usb_kbhit(1)) usb_task();
+        usb_get_packet(1, Buffer, blksize);
+        Blank = 0xFF;
+        for(i = 0; i < blksize; i++) Blank &= Buffer[i];
+        if(Blank != 0xFF) STFlash_WriteBlock(Address, Buffer, blksize);
+        Address += blksize;
+    }
+    Buffer[0] = Make8(n, 1);
+    Buffer[1] = Make8(n, 0);
+    Buffer[2] = 'W';
+    usb_put_packet(1, Buffer, blksize ,USB_DTS_TOGGLE);
+}
+
 //----------------------------------------------------------------------------
 //----------------------------------------------------------------------------
 // FLASH TO FPGA Upload Functions:
@@ -382,10 +443,143 @@ void Write_Flash(int32 Address)
 // example:  actual rbf file size = 218,713 bytes = 0x35659
 // start = 0x180000
 // end   = 0x180000 + 0x35659 = 1B_56_59  
+//----------------------------------------------------------------------------
+// FlashStreamToFPGA shifts Count bytes from a flash read already in progress
+// straight out to the FPGA. The flash gives MSB first and the RBF goes in LSB
+// first, so each byte waits in Rdata between the two unrolled halves; there
+// is no call or int32 arithmetic per byte. With FPGAcd wired it stops at
+// CONF_DONE, FlashToFPGA then clocks FPGA_INIT_BYTES more for initialization.
+//----------------------------------------------------------------------------
+void FlashStreamToFPGA(int32 Count)
+{
+    int8  Rdata, C0, C1, C2;
+
+    C0 = Make8(Count, 0);               // Byte counter, 24 bits is plenty
+    C1 = Make8(Count, 1);
+    C2 = Make8(Count, 2);
+    #asm
+    SByte:  Clrf    Rdata           // Flash sends MSB first, clock idles high
+            Bcf     STF_SCK
+            Btfsc   STF_SO
+            Bsf     Rdata,7
+            Bsf     STF_SCK
+            Bcf     STF_SCK
+            Btfsc   STF_SO
+            Bsf     Rdata,6
+            Bsf     STF_SCK
+            Bcf     STF_SCK
+            Btfsc   STF_SO
+            Bsf     Rdata,5
+            Bsf     STF_SCK
+            Bcf     STF_SCK
+            Btfsc   STF_SO
+            Bsf     Rdata,4
+            Bsf     STF_SCK
+            Bcf     STF_SCK
+            Btfsc   STF_SO
+            Bsf     Rdata,3
+            Bsf     STF_SCK
+            Bcf     STF_SCK
+            Btfsc   STF_SO
+            Bsf     Rdata,2
+            Bsf     STF_SCK
+            Bcf     STF_SCK
+            Btfsc   STF_SO
+            Bsf     Rdata,1
+            Bsf     STF_SCK
+            Bcf     STF_SCK
+            Btfsc   STF_SO
+            Bsf     Rdata,0
+            Bsf     STF_SCK
+
+            Bcf     FPGA_SIO        // FPGA takes it LSB first, clock idles low
+            Btfsc   Rdata,0
+            Bsf     FPGA_SIO
+            Bsf     FPGA_CLK
+            Bcf     FPGA_CLK
+            Bcf     FPGA_SIO
+            Btfsc   Rdata,1
+            Bsf     FPGA_SIO
+            Bsf     FPGA_CLK
+            Bcf     FPGA_CLK
+            Bcf     FPGA_SIO
+            Btfsc   Rdata,2
+            Bsf     FPGA_SIO
+            Bsf     FPGA_CLK
+            Bcf     FPGA_CLK
+            Bcf     FPGA_SIO
+            Btfsc   Rdata,3
+            Bsf     FPGA_SIO
+            Bsf     FPGA_CLK
+            Bcf     FPGA_CLK
+            Bcf     FPGA_SIO
+            Btfsc   Rdata,4
+            Bsf     FPGA_SIO
+            Bsf     FPGA_CLK
+            Bcf     FPGA_CLK
+            Bcf     FPGA_SIO
+            Btfsc   Rdata,5
+            Bsf     FPGA_SIO
+            Bsf     FPGA_CLK
+            Bcf     FPGA_CLK
+            Bcf     FPGA_SIO
+            Btfsc   Rdata,6
+            Bsf     FPGA_SIO
+            Bsf     FPGA_CLK
+            Bcf     FPGA_CLK
+            Bcf     FPGA_SIO
+            Btfsc   Rdata,7
+            Bsf     FPGA_SIO
+            Bsf     FPGA_CLK
+            Bcf     FPGA_CLK
+    #ifdef FPGAcd
+            Btfsc   FPGA_CDONE      // Configured, the rest is padding
+            Goto    SDone
+    #endif
+            Decf    C0,F            // 24 bit decrement, C clear on borrow
+            Bc      SNext
+            Decf    C1,F
+            Bc      SNext
+            Decf    C2,F
+    SNext:  Movf    C0,W            // Any bytes left?
+            Iorwf   C1,W
+            Iorwf   C2,W
+            Bnz     SByte
+    SDone:
+    #endasm
+}
+
+//----------------------------------------------------------------------------
+// Decodes Count bytes of compressed RBF from a flash read already in
+// progress. Literals go through FlashStreamToFPGA, so they cost no more than
+// the raw bitstream; runs are read as three bytes and clocked out locally.
+//----------------------------------------------------------------------------
+void FlashRLEToFPGA(signed int32 Count)
+{
+    int   Data, Value;
+    int16 Run;
+
+    while(Count > 0) {
+        Data = STFlash_GetByte();                   // Record header
+        if(Data & RLE_RUN) {
+            Run   = make16(Data & 0x7F, STFlash_GetByte()) + 1;
+            Value = STFlash_GetByte();
+            LoadFPGARun(Value, Run);
+            Count -= 3;
+        }
+        else {
+            FlashStreamToFPGA((int32)Data + 1);     // Literal, straight through
+            Count -= (int32)Data + 2;
+        }
+#ifdef FPGAcd
+        if(FPGA_CDONE) break;                       // Configured, skip padding
+#endif
+    }
+}
+
 //----------------------------------------------------------------------------
 void FlashToFPGA(void)
 {
-    int   Data;
     int32 Address, End;
     
     Address = get_ee_24(S_ADDR_RBF);    // Start Address
@@ -407,11 +601,12 @@ void FlashToFPGA(void)
     STFlash_sendByte(Make8(Address, 2));    // Send address 
     STFlash_sendByte(Make8(Address, 1));    // Send address
     STFlash_sendByte(Make8(Address, 0));    // Send address
-    do {
-        Data = STFlash_GetByte();
-        LoadFPGAByte(Data);        
-        Address++;
-    } while(Address <= End);
+    if(read_eeprom(RBF_FORMAT) == RBF_RLE)       // End is exclusive for both formats
+         FlashRLEToFPGA(End - Address);
+    else FlashStreamToFPGA(End - Address);       // One continuous read, straight to the FPGA
+#ifdef FPGAcd
+    LoadFPGARun(0xFF, FPGA_INIT_BYTES);          // Clock it through initialization
+#endif
     output_high(FLASH_SELECT);      // Disable select line, we are done reading
     delay_ms(5);                    // Short delay, settling    
 
@@ -422,12 +617,12 @@ void FlashToFPGA(void)
 }
 
 //------------------------------------------------------------------------------
-// Loads RBF from USB to FPGA 
+// Loads RBF from USB to FPGA, Packed selects the compressed RBF format
 //------------------------------------------------------------------------------
-void USBToFPGA(int16 Blks, int Rmdr)
+void USBToFPGA(int16 Blks, int Rmdr, short Packed)
 {
-    int16 i;
-    int8  Buffer[blksize], j, n;
+    int16 i, Run;
+    int8  Buffer[blksize], j, n, State;
 
     Set_Tris_B(TRISB_Config);           // turn on output pin
     
@@ -435,11 +630,31 @@ void USBToFPGA(int16 Blks, int Rmdr)
     delay_ms(50);                    // 50 ms delay to put FPGA into load mode
     Output_High(FPGALoad);           // FPGA Upload pin
     delay_ms(2);                     // Short delay
+    State = RLE_CTL;                 // Records may span USB reports
     for(i = 0; i < Blks; i++) {
         usb_get_packet(1, Buffer, blksize);
         if(i == Blks-1) n = Rmdr;       // Last block
         else            n = blksize;    // regular block
-        for(j = 0; j < n; j++) LoadFPGAByte(Buffer[j]);
+        if(!Packed) {
+            for(j = 0; j < n; j++) LoadFPGAByte(Buffer[j]);
+        }
+        else for(j = 0; j < n; j++) {
+            switch(State) {
+                case RLE_CTL:   Run = Buffer[j] & 0x7F;
+                                if(Buffer[j] & RLE_RUN) State = RLE_LEN;
+                                else { Run++; State = RLE_LIT; }
+                                break;
+                case RLE_LIT:   LoadFPGAByte(Buffer[j]);
+                                if(--Run == 0) State = RLE_CTL;
+                                break;
+                case RLE_LEN:   Run = make16(Run, Buffer[j]) + 1;
+                                State = RLE_VALUE;
+                                break;
+                case RLE_VALUE: LoadFPGARun(Buffer[j], Run);
+                                State = RLE_CTL;
+                                break;
+            }
+        }
         while(!usb_kbhit(1)) usb_task();
     }    
     
@@ -584,6 +799,7 @@ void usb_debug_task(void)
 //      0x0F  Set or clear FPGA load pin and or FPGA Reset Pin
 //      0x10  Upload RBF file from USB line, var1, 2 & 3 are the number of bytes
 //      0x11  Command to configure FPGA from a file stored in FLASH
+//      0x12  Upload compressed RBF from USB line, var1 & 2 blocks, var3 remainder
 //      0x20  Write 1 byte to EEPROM, var1 is address and var2 is the data
 //      0x21  Read 1 byte from EEPROM, var1 is address, data returned in USB report
 //      0x90  Initialize Flash RAM (Makes PIC the SPI master)
@@ -593,6 +809,7 @@ void usb_debug_task(void)
 //      0x94  Write 64 bytes from USB, var1,2&3 address, data in next report
 //      0x95  Write to Flash Status register, var1 is value to write
 //      0x96  Get the Flash Chip ID return in USB report
+//      0x97  Write blocks from USB, var1-4 address, var5&6 count, data in next reports
 //      0x9F  Diables the Flash, makes PIC an SPI Slave
 //      0xA1  Read 32 bytes from RTC, var1 is address, return 32 bytes data in USB report 
 //      0xA2  Write 32 byte to RTC, var1 is address, var2 on is data
@@ -605,7 +822,7 @@ void usb_rcvdata_task(void)
 {
     int data[blksize];
     if(usb_kbhit(1)) {
-        usb_get_packet(1, data, 40);  
+        usb_get_packet(1, data, blksize);  
         switch(data[0]) {
 
             //------------------------------------------------------------------
@@ -625,7 +842,10 @@ void usb_rcvdata_task(void)
                        else                    Output_High(FPGAReset); // FPGA Reset pin                       
                        break;
 
-            case 0x10: USBToFPGA(make16(data[1],data[2]),data[3]);  // Loads USB to FPGA
+            case 0x10: USBToFPGA(make16(data[1],data[2]),data[3],FALSE);  // Loads USB to FPGA
+                       break;
+
+            case 0x12: USBToFPGA(make16(data[1],data[2]),data[3],TRUE);   // Same, compressed RBF
                        break;
 
             case 0x11: FlashToFPGA();  // Loads RBF from Flash to FPGA
@@ -663,6 +883,9 @@ void usb_rcvdata_task(void)
 
             case 0x96: Get_ID();
                        break; 
+
+            case 0x97: Stream_Flash(Make32(data[1],data[2],data[3],data[4]),make16(data[5],data[6]));
+                       break; 
                        
             case 0x9F: Disable_STFlash();           // Disable Flash, yield to FPGA
                        break;
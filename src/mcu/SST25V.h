@@ -26,6 +26,12 @@
 //                                          buffer b at index i
 //
 // void STFlash_eraseBlock(b) - Erase all bytes in block b to 0xFF. A block is 256.    
+//
+// void STFlash_ReadID(id) - Read the 3 byte JEDEC ID into array id
+//
+// void STFlash_WriteBlock(a, b, n) - Program n bytes from array b at address a,
+//                                    AAI word program on SST25VFxxxB parts,
+//                                    256 byte page program on others
 // 
 // void STFlash_waitUntilReady() - Waits until the flash device is ready to accept commands    
 //                                                               
@@ -50,6 +56,25 @@
 //     * * * USER CONFIGURATION Section, set these per Hardware set up * * *
 //------------------------------------------------------------------------------
 // #define     FLASH_SIZE   2097152  // The size of the flash device in bytes
+#define     FLASH_PAGE   256      // Page program size of non-SST parts
+
+short STFlash_AAI = FALSE;        // Set by Init_STFlash(): part supports AAI word program
+void  STFlash_ReadID(int *id);   // Used by Init_STFlash() before it is defined
+
+//------------------------------------------------------------------------------
+// Flash pins by register, must match FLASH_DI, FLASH_CLOCK and FLASH_DO.
+// The MSSP can not be the master here: its SDO is RC7 and SDI is RB0, the
+// reverse of the flash wiring, so the byte routines shift unrolled through
+// LATB/PORTC instead of calling output_bit()/input() in a loop.
+//------------------------------------------------------------------------------
+#byte STF_LATB  = 0x0F8A          // PORTB output latch
+#byte STF_PORTC = 0x0F82          // PORTC pins
+#bit  STF_SI    = STF_LATB.0      // FLASH_DI,    RB0
+#bit  STF_SCK   = STF_LATB.1      // FLASH_CLOCK, RB1
+#bit  STF_SO    = STF_PORTC.7     // FLASH_DO,    RC7
+
+#define STF_OUT(d, n)  STF_SI = bit_test(d, n); STF_SCK = 0; STF_SCK = 1      // flash latches SI on the rising edge
+#define STF_IN(d, n)   STF_SCK = 0; if(STF_SO) bit_set(d, n); STF_SCK = 1      // and drives SO after the falling one
 
 //------------------------------------------------------------------------------
 // Purpose:       Initialize the pins that control the flash device.
@@ -60,11 +85,14 @@
 //------------------------------------------------------------------------------
 void Init_STFlash(void)
 {
+    int id[3];
     Set_Tris_B(TRISB_Master);     // Flash Disabled, turn on output pins
     Set_Tris_C(TRISC_Master);     // Set up for PIC being Master 
     output_high(FLASH_SELECT);    // FLASH_SELECT high
     output_high(FLASH_CLOCK);     // Clock High
-    
+
+    STFlash_ReadID(id);                                 // SST, SST25 family: the B parts
+    STFlash_AAI = (id[0] == 0xBF && id[1] == 0x25);     // only byte program with 0x02
 }
 
 //------------------------------------------------------------------------------
@@ -88,13 +116,14 @@ void Disable_STFlash(void)
 //------------------------------------------------------------------------------
 void STFlash_SendByte(int data)
 {
-    int i;
-    for(i=0; i<8; ++i) {
-        output_bit(FLASH_DI, shift_left(&data,1,0));    // Send a data bit
-        output_low(FLASH_CLOCK);
-        delay_cycles(10);                                // Same as a NOP
-        output_high(FLASH_CLOCK);                       // Pulse the clock
-   }
+    STF_OUT(data, 7);                   // Send the data bits, MSB first
+    STF_OUT(data, 6);
+    STF_OUT(data, 5);
+    STF_OUT(data, 4);
+    STF_OUT(data, 3);
+    STF_OUT(data, 2);
+    STF_OUT(data, 1);
+    STF_OUT(data, 0);
 }
 
 //------------------------------------------------------------------------------
@@ -105,13 +134,16 @@ void STFlash_SendByte(int data)
 //------------------------------------------------------------------------------
 int STFlash_GetByte(void)
 {
-    int i, flashData;
-    for(i=0; i<8; ++i) {
-        output_low(FLASH_CLOCK);
-        shift_left(&flashData, 1, input(FLASH_DO));      
-        output_high(FLASH_CLOCK);                       // Pulse the clock
-    }
-   return(flashData);
+    int flashData = 0;
+    STF_IN(flashData, 7);               // Get the data bits, MSB first
+    STF_IN(flashData, 6);
+    STF_IN(flashData, 5);
+    STF_IN(flashData, 4);
+    STF_IN(flashData, 3);
+    STF_IN(flashData, 2);
+    STF_IN(flashData, 1);
+    STF_IN(flashData, 0);
+    return(flashData);
 }
 
 //------------------------------------------------------------------------------
@@ -122,13 +154,26 @@ int STFlash_GetByte(void)
 //------------------------------------------------------------------------------
 void STFlash_waitUntilReady(void)
 {
-/*
    output_low(FLASH_SELECT);               // Enable select line
    STFlash_sendByte(0x05);                 // Send status command
-   while(input(FLASH_DO));                 // Wait until ready
-   STFlash_GetByte();                      // Get byte 
+   while(STFlash_GetByte() & 0x01);        // Status repeats until BUSY clears
    output_high(FLASH_SELECT);              // Disable select line
-*/   
+}
+
+//------------------------------------------------------------------------------
+// Purpose:       Read the JEDEC ID of the flash device
+// Inputs:        A pointer to a 3 byte array: manufacturer, type, capacity
+// Outputs:       None
+// Dependencies:  STFlash_sendData(), STFlash_getByte()
+//------------------------------------------------------------------------------
+void STFlash_ReadID(int *id)
+{
+   output_low(FLASH_SELECT);            // Enable select line
+   STFlash_SendByte(0x9F);              // Send JEDEC command
+   id[0] = STFlash_GetByte();           // Manufacturer, 0xBF = SST
+   id[1] = STFlash_GetByte();           // Memory type
+   id[2] = STFlash_GetByte();           // Capacity
+   output_high(FLASH_SELECT);           // Disable select line
 }
 
 //------------------------------------------------------------------------------
@@ -204,15 +249,8 @@ void STFlash_writeStatus(int value)
 void STFlash_getBytes(int *data, int16 size)
 {
     int16 i;
-    signed int  j;
    
-    for(i=0; i<size; ++i) {
-        for(j=0; j<8; ++j) {
-            output_low(FLASH_CLOCK);
-            shift_left(data+i, 1, input(FLASH_DO));
-            output_high(FLASH_CLOCK);
-        }
-    }
+    for(i=0; i<size; ++i) data[i] = STFlash_GetByte();
 }
 
 //------------------------------------------------------------------------------
@@ -256,25 +294,102 @@ void STFlash_Write1Byte(int32 Address, int data)
 }
 
 //------------------------------------------------------------------------------
-// STFlash_WriteBlock()
+// STFlash_WriteAAI()
 //
-// Purpose:       Writes a block of data (usually 256 bytes) to the ST
-//                Flash from a buffer pointed to by int Buffer;
+// Purpose:       Programs with the SST Auto Address Increment word sequence:
+//                WREN, AD + address + 2 bytes, then AD + 2 bytes per word,
+//                polling BUSY after each, and WRDI to leave AAI mode. An odd
+//                first or last byte is byte programmed.
 //
-// Inputs:        1) Address of block to read from
-//                2) A pointer to an array to fill
-//                3) The number of bytes of data to read
+// Inputs:        1) Address to start programming at
+//                2) A pointer to the data
+//                3) The number of bytes to program
 // Outputs:       None
 //------------------------------------------------------------------------------
-void STFlash_WriteBlock(int32 Address, int buffer[], int16 size)
+void STFlash_WriteAAI(int32 Address, int buffer[], int16 size)
 {
-    int16 i;
-    for(i = 0; i < size; i++) {
+    int16 i = 0;
+
+    if(size && (Make8(Address, 0) & 0x01)) {    // AAI starts on an even address
+        STFlash_WriteEnable();
+        STFlash_Write1Byte(Address, buffer[0]);
+        STFlash_waitUntilReady();
+        i = 1;
+    }
+    if(i + 1 < size) {
+        STFlash_WriteEnable();
+        output_low(FLASH_SELECT);               // Enable select line
+        STFlash_sendByte(0xAD);                 // Send Opcode
+        STFlash_sendByte(Make8(Address+i, 2));  // Send Address 
+        STFlash_sendByte(Make8(Address+i, 1));  // Send Address
+        STFlash_sendByte(Make8(Address+i, 0));  // Send Address
+        STFlash_SendByte(buffer[i]);            // Send Data
+        STFlash_SendByte(buffer[i+1]);          // Send Data
+        output_high(FLASH_SELECT);              // Disable select line
+        STFlash_waitUntilReady();
+        for(i += 2; i + 1 < size; i += 2) {
+            output_low(FLASH_SELECT);           // Enable select line
+            STFlash_sendByte(0xAD);             // Send Opcode, address increments
+            STFlash_SendByte(buffer[i]);        // Send Data
+            STFlash_SendByte(buffer[i+1]);      // Send Data
+            output_high(FLASH_SELECT);          // Disable select line
+            STFlash_waitUntilReady();
+        }
+        STFlash_WriteDisable();                 // WRDI ends AAI mode
+    }
+    if(i < size) {                              // Odd byte left over
         STFlash_WriteEnable();
         STFlash_Write1Byte(Address+i, buffer[i]);
-        delay_us(10);
-        while(STFlash_readStatus() & 0x01);
+        STFlash_waitUntilReady();
+    }
+}
+
+//------------------------------------------------------------------------------
+// STFlash_WritePages()
+//
+// Purpose:       Programs with 0x02 page program, up to FLASH_PAGE bytes per
+//                command, never crossing a page boundary.
+//
+// Inputs:        1) Address to start programming at
+//                2) A pointer to the data
+//                3) The number of bytes to program
+// Outputs:       None
+//------------------------------------------------------------------------------
+void STFlash_WritePages(int32 Address, int buffer[], int16 size)
+{
+    int16 i, j, n;
+
+    for(i = 0; i < size; i += n) {
+        n = FLASH_PAGE - Make8(Address+i, 0);   // Bytes left in this page
+        if(n > size - i) n = size - i;
+        STFlash_WriteEnable();
+        output_low(FLASH_SELECT);               // Enable select line
+        STFlash_sendByte(0x02);                 // Send Opcode
+        STFlash_sendByte(Make8(Address+i, 2));  // Send Address 
+        STFlash_sendByte(Make8(Address+i, 1));  // Send Address
+        STFlash_sendByte(Make8(Address+i, 0));  // Send Address
+        for(j = 0; j < n; j++) STFlash_SendByte(buffer[i+j]);
+        output_high(FLASH_SELECT);              // Disable select line
+        STFlash_waitUntilReady();
     }
+}
+
+//------------------------------------------------------------------------------
+// STFlash_WriteBlock()
+//
+// Purpose:       Writes a block of data (usually 64 bytes) to the ST
+//                Flash from a buffer pointed to by int Buffer, using AAI
+//                on SST parts and page program on others, see Init_STFlash()
+//
+// Inputs:        1) Address of block to write to
+//                2) A pointer to the data
+//                3) The number of bytes of data to write
+// Outputs:       None
+//------------------------------------------------------------------------------
+void STFlash_WriteBlock(int32 Address, int buffer[], int16 size)
+{
+    if(STFlash_AAI) STFlash_WriteAAI(Address, buffer, size);
+    else            STFlash_WritePages(Address, buffer, size);
     STFlash_WriteDisable();
 }
 
@@ -96,7 +96,7 @@ const char USB_CONFIG_DESC[] = {
          0x81,                   //endpoint number and direction (0x81 = EP1 IN)       ==30
          0x03,                   //transfer type supported (0x03 is interrupt)         ==31
          USB_EP1_TX_SIZE,0x00,   //maximum packet size supported                  ==32,33
-         10,                     //polling interval, in ms.  (cant be smaller than 10)      ==34
+         1,                      //polling interval, in ms.  (full speed allows 1)          ==34
 
    //endpoint descriptor
          USB_DESC_ENDPOINT_LEN,  //length of descriptor                   ==35
@@ -104,7 +104,7 @@ const char USB_CONFIG_DESC[] = {
          0x01,                   //endpoint number and direction (0x01 = EP1 OUT)      ==37
          0x03,                   //transfer type supported (0x03 is interrupt)         ==38
          USB_EP1_RX_SIZE,0x00,   //maximum packet size supported                  ==39,40
-         10                      //polling interval, in ms.  (cant be smaller than 10)    ==41
+         1                       //polling interval, in ms.  (full speed allows 1)        ==41
 };
 //------------------------------------------------------------------------------
 //****** BEGIN CONFIG DESCRIPTOR LOOKUP TABLES ********
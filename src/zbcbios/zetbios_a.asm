@@ -36,6 +36,11 @@ IPL_SEQUENCE_OFFSET     equ     0082h    ; u16: next boot device
 IPL_BOOTFIRST_OFFSET    equ     0084h    ; u16: user selected device
 IPL_TABLE_ENTRIES       equ     8        ; num Table entries
 IPL_TYPE_BEV            equ     080h     ;
+KBD_BUFFER_START        equ     00B0h    ; 32 entry keystroke buffer in the BDA, must match
+KBD_BUFFER_END          equ     00F0h    ; KBD_BUFFER_xxx in zetbios_c.h (001Eh/003Eh for 16)
+EBDA_MOUSE_WANT         equ     0130h    ; u8: bytes the pending INT15 C2h command expects, see zetbios_c.h
+EBDA_MOUSE_GOT          equ     0131h    ; u8: bytes stored so far
+EBDA_MOUSE_RESP         equ     0132h    ; u8[4]: ack and response bytes
 
 ;;--------------------------------------------------------------------------
 ;; ROM Utilities Externals
@@ -44,9 +49,11 @@ IPL_TYPE_BEV            equ     080h     ;
                         EXTRN  _int13_diskette_function:proc      ; Contained in C source module
                         EXTRN  _MakeRamdisk            :proc      ; Contained in C source module 
                         EXTRN  _int13_harddisk         :proc      ; Contained in C source module
+                        EXTRN  _sd_card_post           :proc      ; SD card init and geometry
                         EXTRN  _boot_halt              :proc      ; Contained in C source module
                         EXTRN  _int19_function         :proc      ; Contained in C source module
                         EXTRN  _int14_function         :proc      ; Contained in C source module
+                        EXTRN  _int0c_function         :proc      ; COM1 IRQ4 service
                         EXTRN  _int15_function         :proc      ; Contained in C source module
                         EXTRN  _int15_function_mouse   :proc      ; Contained in C source module
                         EXTRN  _int1a_function         :proc      ; Time-of-day Service Entry Point
@@ -170,6 +177,7 @@ ebda_post:              mov     ax, EBDA_SEG                          ;; EBDA Se
                         mov     ds, ax                                ;; Set data segment to it
                         mov     byte ptr ds:0x0000, EBDA_SIZE         ;; Load the size in to 1st byte
                         mov     byte ptr ds:0x0027, 0x00              ;; Clear flags
+                        mov     byte ptr ds:EBDA_MOUSE_WANT, 0x00     ;; IRQ12 bytes are movement packets
                         xor     ax, ax                                ;; BDA Segment
                         mov     ds, ax                                ;; Set data segment to it
                         mov     word ptr ds:0x040E, EBDA_SEG          ;; Save the EBDA seg in BDA 
@@ -192,12 +200,12 @@ ebda_post:              mov     ax, EBDA_SEG                          ;; EBDA Se
                         mov     BYTE PTR ds:00497h, al      ; keyboard status flags 4
                         mov     al, 010h
                         mov     BYTE PTR ds:00496h, al      ; keyboard status flags 3
-                        mov     bx, 001Eh                   ; keyboard head of buffer pointer
+                        mov     bx, KBD_BUFFER_START        ; keyboard head of buffer pointer
                         mov     WORD PTR ds:0041Ah, bx
                         mov     WORD PTR ds:0041Ch, bx      ; keyboard end of buffer pointer
-                        mov     bx, 001Eh                   ; keyboard pointer to start of buffer
+                        mov     bx, KBD_BUFFER_START        ; keyboard pointer to start of buffer
                         mov     WORD PTR ds:00480h, bx
-                        mov     bx, 003Eh                   ; keyboard pointer to end of buffer
+                        mov     bx, KBD_BUFFER_END          ; keyboard pointer to end of buffer
                         mov     WORD PTR ds:00482h, bx
 
                         mov     bx, 03F8h                   ; COM1 Adapter
@@ -215,6 +223,8 @@ ebda_post:              mov     ax, EBDA_SEG                          ;; EBDA Se
                         SET_INT_VECTOR 01Ah, 0F000h, int1a_handler    ;; CMOS RTC
                         SET_INT_VECTOR 010h, 0F000h, int10_handler    ;; int10_handler - Video Support Service Entry Point
 
+                        sti                            ;; enable interrupts, the tick count
+                                                       ;; times the POST phases from here
                         mov     cx, 0c000h             ;; init vga bios
                         mov     ax, 0c780h
                         call    rom_scan               ;; Scan ROM  
@@ -229,7 +239,6 @@ ebda_post:              mov     ax, EBDA_SEG                          ;; EBDA Se
                         mov     ax, 0e000h             ;; Initialize option roms
                         call    rom_scan               ;; Call the rom scan again
 
-                        sti                            ;; enable interrupts
                         int     019h                   ;; Now load dos boot sector and jump to it
 
 ;;--------------------------------------------------------------------------
@@ -283,72 +292,8 @@ hard_drive_post:        xor     ax, ax           ; Clear ax
                         SET_INT_VECTOR 013h, 0F000h, int13_handler
                         SET_INT_VECTOR 076h, 0F000h, int76_handler
 
-                        mov     al, 0ffh         ; Initialize the SD card controller
-                        mov     dx, 0100h        ; Location of SD controller 
-                        mov     cx, 10           ; Number of times to repeat
-  
-hd_post_init80:         out     dx, al           ; 80 cycles of initialization
-                        loop    hd_post_init80   ; Looop 80 times
-                        mov     ax, 040h         ; CS = 0, CMD0: reset the SD card
-                        out     dx, ax           ; Reset the card 
-                        xor     al, al           ; Clear al
-                        out     dx, al           ; 32-bit zero value
-                        out     dx, al
-                        out     dx, al
-                        out     dx, al
-                        mov     al, 095h         ; Fixed value
-                        out     dx, al           ; load it
-                        mov     al, 0ffh         
-                        out     dx, al           ; wait
-                        in      al, dx           ; status
-                        mov     cl, al
-                        mov     ax, 0ffffh
-                        out     dx, ax           ; CS = 1
-                        cmp     cl, 1
-                        je      hd_post_cmd1
-                        mov     al, 1            ; error 1
-                        mov     ds:0048dh, al
-                        ret
-
-hd_post_cmd1:           mov     ax, 041h        ; CS = 0, CMD1: activate the init sequence
-                        out     dx, ax
-                        xor     al, al
-                        out     dx, al          ; 32-bit zero value
-                        out     dx, al
-                        out     dx, al
-                        out     dx, al
-                        mov     al, 0ffh
-                        out     dx, al          ; CRC (not used)
-                        out     dx, al          ; wait
-                        in      al, dx          ; status
-                        mov     cl, al
-                        mov     ax, 0ffffh
-                        out     dx, ax          ; CS = 1
-                        test    cl, 0ffh
-                        jnz     hd_post_cmd1
-                        
-                        mov     ax, 050h        ; CS = 0, CMD16: set block length
-                        out     dx, ax
-                        xor     al, al
-                        out     dx, al          ; 32-bit value
-                        out     dx, al
-                        mov     al, 2           ; 512 bytes
-                        out     dx, al
-                        xor     al, al
-                        out     dx, al
-                        mov     al, 0ffh
-                        out     dx, al          ; CRC (not used)
-                        out     dx, al          ; wait
-                        in      al, dx          ; status
-                        mov     cl, al
-                        mov     ax, 0ffffh
-                        out     dx, ax          ; CS = 1
-                        test    cl, 0ffh
-                        jz      hd_post_success
-                        mov     al, 2           ; error 2
-                        mov     ds:0048dh, al
+                        call    _sd_card_post    ; Initialize the SD card, error stage in 40:8D
                         ret
-hd_post_success:        ret
 
 ;;--------------------------------------------------------------------------
 ;;--------------------------------------------------------------------------
@@ -662,6 +607,22 @@ baud_rates:             dw      0417h               ;    110 baud clock divisor
                         dw      0002h               ;  57600 baud clock divisor
                         dw      0001h               ; 115200 baud clock divisor
 
+;;--------------------------------------------------------------------------
+;; IRQ4 - COM1 receive/transmit, installed by INT14 AH=00 when the C module
+;; is built with COM1_BUFFERED
+;;--------------------------------------------------------------------------
+                        PUBLIC  int0C_handler
+int0C_handler:          push    ds                  ; save everything the
+                        push    es                  ; C code may change
+                        PUSHALL
+                        xor     ax, ax
+                        mov     ds, ax              ; make data segment 0
+                        call    _int0c_function
+                        POPALL
+                        pop     es
+                        pop     ds
+                        iret
+
 ;int14_handler:         sti                         ; Serial com. RS232 services
 ;                       cli                         ; enale interrupts
 ;                       iret                        ; Baud Rate Generator Table
@@ -669,11 +630,8 @@ baud_rates:             dw      0417h               ;    110 baud clock divisor
 ;;--------------------------------------------------------------------------
 ;;--------------------------------------------------------------------------
 ;; INT16 Keyboard Service Entry Point -
-;; This interupt service routine checks the AH register to see if the user
-;; wants to check for a key or wait for a key. If AH==0, then the user is 
-;; checking (equivalent of C kbhit) if AH=10h then they want to wait. In either
-;; case, the C helper function int16_function() is called to get the keyboard
-;; input.
+;; All functions are handled by the C helper function int16_function(),
+;; including the AH=00h/10h waits for a key stroke, see kbd_wait().
 ;;--------------------------------------------------------------------------
 ;;--------------------------------------------------------------------------
                         org     (0e82eh - startofrom)
@@ -684,12 +642,8 @@ int16_handler:          sti                             ;; Enable interupts
                         push    bp                      ;;
                         push    si                      ;;
                         push    di                      ;;
-                        cmp     ah, 00h                 ;; Check to see what command
-                        je      int16_F00               ;; was issued with the call
-                        cmp     ah, 010h                ;; If either 0x00 or 0x10
-                        je      int16_F00               ;; then it is a wait for key loop command
-                        mov     bx, 0f000h              ;; Otherwise, just check for a key
-                        mov     ds, bx                  ;; First set the data seg to the bios
+                        mov     bx, 0f000h              ;; First set the data seg
+                        mov     ds, bx                  ;; to the bios
                         pushf                           ;; Push the parms on the stack
                         push    cx                      ;; for the C program to receive
                         push    ax                      ;; Pass the user command
@@ -716,34 +670,6 @@ int16_zero_set:         push    bp                              ;; Save the base
                         pop     bp                              ;; Restore the BP register
                         iret                                    ;; return from interupt
 
-int16_F00:              mov     bx, 0040h               ;; Point to the correct data seg
-                        mov     ds, bx                  ;; Set up the DS
-int16_wait_for_key:     cli                             ;; Loop and Wait for the key
-                        mov     bx, ds:001ah            ;; The head and tail of the buffer
-                        cmp     bx, ds:001ch            ;; If they are not equal a key was put on the buffer
-                        jne     int16_key_found         ;; Found the key, lets go process it
-                        sti                             ;; Enable interupts agains
-                        nop                             ;; No operation
-                        jmp     int16_wait_for_key      ;; Continue looping until key is received
-                        
-int16_key_found:        mov     bx, 0f000h              ;; Otherwise, just check for a key
-                        mov     ds, bx                  ;; First set the data seg to the bios
-                        pushf                           ;; Push the parms on the stack
-                        push    cx                      ;; for the C program to receive
-                        push    ax                      ;; Pass the user command
-                        call    _int16_function         ;; Now call the function
-                        pop     ax                      ;; Now restor the stack
-                        pop     cx                      ;;
-                        popf                            ;; Flags should have ZF set correctly
-
-                        pop     di                      ;; Now restore all the saved
-                        pop     si                      ;; registers from above
-                        pop     bp                      ;; 
-                        pop     bx                      ;;
-                        pop     dx                      ;;
-                        pop     ds                      ;;
-                        iret                            ;; return from interupt
-
 
 ;;--------------------------------------------------------------------------
 ;;--------------------------------------------------------------------------
@@ -768,7 +694,14 @@ int74_handler:          sti                             ;; Disable interupt
                                                         ;; ds = ebda seg now, so now we can do mouse stuff
                         mov     dx, MOUSE_PORT          ;; load address of mouse port
                         in      al, dx                  ;; Get input byte
-                        mov     bl, byte ptr ds:0x26    ;; Get current packet counter (and other flags)
+                        xor     bx, bx                  ;; Is mouse_command() waiting for
+                        mov     bl, byte ptr ds:EBDA_MOUSE_GOT  ;; an ack or response byte ?
+                        cmp     bl, byte ptr ds:EBDA_MOUSE_WANT ;;
+                        jae     int74_packet            ;; No, it is part of a movement packet
+                        mov     byte ptr ds:[EBDA_MOUSE_RESP+bx], al ;; Yes, hand it over
+                        inc     byte ptr ds:EBDA_MOUSE_GOT      ;;
+                        jmp     int74_done              ;; and wake it up on the way out
+int74_packet:           mov     bl, byte ptr ds:0x26    ;; Get current packet counter (and other flags)
                         mov     dl, bl                  ;; Save it as is with other flags in dl
                         and     bx, 0x07                ;; mask off upper bits in bx so we can use it as an index
                         mov     byte ptr ds:[0x28+bx],al ; Save the input byte into circular buffer
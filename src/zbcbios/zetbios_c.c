@@ -20,6 +20,8 @@ Bit16u get_SS(void) { __asm { mov  ax, ss } }
 
 //--------------------------------------------------------------------------
 //  memset of count bytes
+//  The bus is 16 bits wide, so the fill is done a word at a time: one byte
+//  first if the destination is odd, then rep stosw and a byte for an odd tail
 //--------------------------------------------------------------------------
 static void memsetb(Bit16u s_segment, Bit16u s_offset, Bit8u value, Bit16u count)
 {
@@ -36,8 +38,16 @@ static void memsetb(Bit16u s_segment, Bit16u s_offset, Bit8u value, Bit16u count
                     mov  ax, s_offset     // offset 
                     mov  di, ax
                     mov  al, value        // value 
+                    mov  ah, al
                     cld
-                    rep stosb
+                    test di, 1            // word align the destination
+                    je   memsetb_even
+                    stosb
+                    dec  cx
+     memsetb_even:  shr  cx, 1            // words, odd byte into carry
+                    rep  stosw
+                    adc  cx, cx           // 1 if there is a byte left
+                    rep  stosb
      memsetb_end:   pop di
                     pop es
                     pop cx
@@ -46,6 +56,7 @@ static void memsetb(Bit16u s_segment, Bit16u s_offset, Bit8u value, Bit16u count
 }
 //--------------------------------------------------------------------------
 //  memcpy of count bytes 
+//  Copied a word at a time like memsetb, with the destination word aligned
 //--------------------------------------------------------------------------
 static void memcpyb(Bit16u d_segment, Bit16u d_offset, Bit16u s_segment, Bit16u s_offset, Bit16u count)
 {
@@ -68,6 +79,13 @@ static void memcpyb(Bit16u d_segment, Bit16u d_offset, Bit16u s_segment, Bit16u
                     mov  ax, s_offset   // soffset  
                     mov  si, ax
                     cld
+                    test di, 1          // word align the destination
+                    je   memcpyb_even
+                    movsb
+                    dec  cx
+      memcpyb_even: shr  cx, 1          // words, odd byte into carry
+                    rep  movsw
+                    adc  cx, cx         // 1 if there is a byte left
                     rep  movsb
       memcpyb_end:  pop si
                     pop ds
@@ -94,12 +112,112 @@ static void wrch(Bit8u character)
             pop     bx
     }
 }
+#if BIOS_TTY_DIRECT
+//--------------------------------------------------------------------------
+// Teletype output straight into the text buffer of the active page, with
+// the same CR/LF/BS handling and scrolling as INT 10h AH=0Eh. Only the
+// cursor in the BDA moves, tty_sync() hands it to the video BIOS once the
+// string is out. Graphics modes and the bell still go through INT 10h.
+//--------------------------------------------------------------------------
+static void tty_putc(Bit8u c)
+{
+    Bit16u seg, base, cols, rows, i;
+    Bit8u  mode, page, col, row;
+
+    mode = read_byte(0x0040, 0x0049);
+    cols = read_word(0x0040, 0x004a);           // 0 until the video BIOS is up
+    if((mode > 3 && mode != 7) || cols == 0 || c == 0x07) {
+        wrch(c);
+        return;
+    }
+    seg  = (mode == 7) ? 0xB000 : 0xB800;
+    base = read_word(0x0040, 0x004e);           // start of the active page
+    rows = read_byte(0x0040, 0x0084) + 1;       // 0 if the video BIOS does not keep it
+    if(rows < 2) rows = 25;
+    page = read_byte(0x0040, 0x0062);
+    col  = read_byte(0x0040, 0x0050 + (page << 1));
+    row  = read_byte(0x0040, 0x0051 + (page << 1));
+
+    switch(c) {
+        case '\r': col = 0;       break;
+        case '\n': row++;         break;
+        case '\b': if(col) col--; break;
+        default:
+            write_byte(seg, base + ((row * cols + col) << 1), c);     // attribute stays
+            if(++col >= cols) {
+                col = 0;
+                row++;
+            }
+            break;
+    }
+    if(row >= rows) {                           // scroll the page up one line
+        memcpyb(seg, base, seg, base + (cols << 1), ((rows - 1) * cols) << 1);
+        base += ((rows - 1) * cols) << 1;
+        for(i = 0; i < cols; i++) write_word(seg, base + (i << 1), 0x0720);
+        row = rows - 1;
+    }
+    write_byte(0x0040, 0x0050 + (page << 1), col);
+    write_byte(0x0040, 0x0051 + (page << 1), row);
+}
+//--------------------------------------------------------------------------
+// Move the hardware cursor to where tty_putc() left the BDA cursor
+//--------------------------------------------------------------------------
+static void tty_sync(void)
+{
+    Bit8u page, col, row;
+
+    page = read_byte(0x0040, 0x0062);
+    col  = read_byte(0x0040, 0x0050 + (page << 1));
+    row  = read_byte(0x0040, 0x0051 + (page << 1));
+    __asm {
+            push    ax
+            push    bx
+            push    dx
+            mov     ah, 0x02        // set cursor position
+            mov     bh, page
+            mov     dh, row
+            mov     dl, col
+            int     0x10
+            pop     dx
+            pop     bx
+            pop     ax
+    }
+}
+#endif
+#if BIOS_TTY_SERIAL
+//--------------------------------------------------------------------------
+// COM1 mirror, the wait for the transmitter is bounded so a port that is
+// not there cannot hang POST.
+//--------------------------------------------------------------------------
+static void serial_putc(Bit8u c)
+{
+    Bit16u addr, n;
+
+    addr = read_word(0x0040, 0x0000);           // COM1 base
+    if(addr == 0) return;
+    for(n = 0; n < 0x4000; n++) {
+        if(inb(addr + 5) & 0x20) {              // THR empty
+            outb(addr, c);
+            return;
+        }
+    }
+}
+#endif
 //--------------------------------------------------------------------------
 static void send(Bit16u action, Bit8u  c)
 {
     if(action & BIOS_PRINTF_SCREEN) {
+#if BIOS_TTY_SERIAL
+        if(c == '\n') serial_putc('\r');
+        serial_putc(c);
+#endif
+#if BIOS_TTY_DIRECT
+        if(c == '\n') tty_putc('\r');
+        tty_putc(c);
+#else
         if(c == '\n') wrch('\r');
         wrch(c);
+#endif
     }
 }
 //--------------------------------------------------------------------------
@@ -159,10 +277,11 @@ static void bios_printf(Bit16u action, Bit8u *s, ...)
     bx_bool  in_format;
     short    i;
     Bit16u  *arg_ptr;
-    Bit16u   arg_seg, arg, nibble, hibyte, format_width, hexadd;
+    Bit16u   arg_seg, arg, nibble, hibyte, format_width, hexadd, fmt_seg;
 
     arg_ptr = (Bit16u  *)&s;
     arg_seg = get_SS();
+    fmt_seg = get_CS();                 // the format strings live in the ROM
 
     in_format = 0;
     format_width = 0;
@@ -170,7 +289,7 @@ static void bios_printf(Bit16u action, Bit8u *s, ...)
     if((action & BIOS_PRINTF_DEBHALT) == BIOS_PRINTF_DEBHALT)
         bios_printf(BIOS_PRINTF_SCREEN, "FATAL: ");
 
-        while(c = read_byte(get_CS(), (Bit16u)s)) {
+    while(c = read_byte(fmt_seg, (Bit16u)s)) {
         if( c == '%' ) {
             in_format = 1;
             format_width = 0;
@@ -196,7 +315,7 @@ static void bios_printf(Bit16u action, Bit8u *s, ...)
                 }
                 else if(c == 'l') {
                     s++;
-                    c = read_byte(get_CS(), (Bit16u)s);       // is it ld,lx,lu? 
+                    c = read_byte(fmt_seg, (Bit16u)s);             // is it ld,lx,lu? 
                     arg_ptr++;                                // increment to next arg
                     hibyte = read_word(arg_seg, (Bit16u)arg_ptr);
                     if(c == 'd') {
@@ -221,7 +340,7 @@ static void bios_printf(Bit16u action, Bit8u *s, ...)
                     else             put_int(action, arg, format_width, 0);
                 }
                 else if(c == 's') {
-                    put_str(action, get_CS(), arg);
+                    put_str(action, fmt_seg, arg);
                 }
                 else if(c == 'S') {
                     hibyte = arg;
@@ -241,6 +360,9 @@ static void bios_printf(Bit16u action, Bit8u *s, ...)
         }
         s ++;
     }
+#if BIOS_TTY_DIRECT
+    if(action & BIOS_PRINTF_SCREEN) tty_sync();    // one cursor update per string
+#endif
     if(action & BIOS_PRINTF_HALT) {  // freeze in a busy loop.
         __asm {
                         cli
@@ -266,6 +388,51 @@ void __cdecl print_bios_banner(void)
     bios_printf(BIOS_PRINTF_SCREEN,BIOS_BUILD_DATE);
     bios_printf(BIOS_PRINTF_SCREEN,BIOS_VERS);
     bios_printf(BIOS_PRINTF_SCREEN,BIOS_DATE);
+#if BOOT_PROFILE
+    write_word(EBDA_SEG, EBDA_BOOT_TICKS, 0);   // BOOT_MARK_START
+#endif
+#if RTC_CACHE
+    write_byte(EBDA_SEG, EBDA_RTC_VALID, 0);    // the EBDA is not cleared at POST
+#endif
+    boot_profile_stamp(BOOT_MARK_VIDEO);
+}
+
+//--------------------------------------------------------------------------
+//--------------------------------------------------------------------------
+// Boot profile - each POST phase ends with boot_profile_stamp(), which
+// records the BDA tick count (55ms per tick) in the EBDA for DOS tools to
+// read. POST clears the tick count and enables interrupts just before the
+// video ROM, so the start mark is always 0.
+//--------------------------------------------------------------------------
+//--------------------------------------------------------------------------
+#if BOOT_PROFILE && BOOT_PROFILE_BANNER
+static char boot_phases[][12] = { "video", "RAM disk", "SD card", "boot table", "option ROMs", "boot sector" };
+#endif
+
+static void boot_profile_stamp(Bit8u mark)
+{
+#if BOOT_PROFILE
+    write_word(EBDA_SEG, EBDA_BOOT_TICKS + (mark << 1), read_word(0x0040, 0x006c));
+    write_byte(EBDA_SEG, EBDA_BOOT_MARKS, mark + 1);
+#endif
+}
+//--------------------------------------------------------------------------
+static void boot_profile_print(void)
+{
+#if BOOT_PROFILE && BOOT_PROFILE_BANNER
+    Bit8u  mark, marks;
+    Bit16u last, now;
+
+    marks = read_byte(EBDA_SEG, EBDA_BOOT_MARKS);
+    last  = read_word(EBDA_SEG, EBDA_BOOT_TICKS);
+    printf("POST:");
+    for(mark = 1; mark < marks; mark++) {
+        now = read_word(EBDA_SEG, EBDA_BOOT_TICKS + (mark << 1));
+        printf(" %s %lu", boot_phases[mark - 1], (Bit32u)(now - last) * 55);
+        last = now;
+    }
+    printf(" ms\n");
+#endif
 }
 
 //--------------------------------------------------------------------------
@@ -293,6 +460,7 @@ void __cdecl init_boot_vectors(void)
     Bit16u      hdi, fdi;
     Bit16u      ss = get_SS();
 
+    boot_profile_stamp(BOOT_MARK_SD);               // hard_drive_post has just run
     memsetb(IPL_SEG, IPL_TABLE_OFFSET, 0, IPL_SIZE);  // Clear out the IPL table. 
 
     write_word(IPL_SEG, IPL_BOOTFIRST_OFFSET, 0xFFFF);  // User selected device not set 
@@ -323,6 +491,7 @@ void __cdecl init_boot_vectors(void)
     }
     write_word(IPL_SEG, IPL_COUNT_OFFSET, count);   // Remember how many devices we have 
     write_word(IPL_SEG, IPL_SEQUENCE_OFFSET, 1);    // Try to boot first boot device 
+    boot_profile_stamp(BOOT_MARK_IPL);
 }
 
 //--------------------------------------------------------------------------
@@ -352,19 +521,16 @@ static void print_boot_failure(Bit16u type, Bit8u reason)
 //--------------------------------------------------------------------------
 static BOOL __cdecl dequeue_key(Bit8u BASESTK *scan_code, Bit8u BASESTK *ascii_code, int incr)
 {
-    Bit16u buffer_start, buffer_end, buffer_head, buffer_tail;
-
-    buffer_start = read_word(0x0040, 0x0080);
-    buffer_end   = read_word(0x0040, 0x0082);
-    buffer_head  = read_word(0x0040, 0x001a);
-    buffer_tail  = read_word(0x0040, 0x001c);
+    Bit16u buffer_head, key;
 
-    if(buffer_head != buffer_tail) {
-        *ascii_code  = read_byte(0x0040, buffer_head);
-        *scan_code   = read_byte(0x0040, buffer_head+1);
+    buffer_head = read_word(0x0040, 0x001a);
+    if(buffer_head != read_word(0x0040, 0x001c)) {
+        key         = read_word(0x0040, buffer_head);
+        *ascii_code = (Bit8u)key;
+        *scan_code  = key >> 8;
         if(incr) {
             buffer_head += 2;
-            if(buffer_head >= buffer_end) buffer_head = buffer_start;
+            if(buffer_head >= KBD_BUFFER_END) buffer_head = KBD_BUFFER_START;
             write_word(0x0040, 0x001a, buffer_head);
         }
         return(1);
@@ -372,6 +538,38 @@ static BOOL __cdecl dequeue_key(Bit8u BASESTK *scan_code, Bit8u BASESTK *ascii_c
     return(0);
 }
 
+//--------------------------------------------------------------------------
+// Wait for a key stroke - INT16 AH=00h/10h. INT15 AX=9002h tells a
+// multitasker we are about to idle, then the CPU halts until an interrupt
+// puts a key in the buffer. INT09 reports that with INT15 AX=9102h.
+// The sti before hlt only takes effect after it, so a key arriving between
+// the check and the hlt still wakes us up.
+//--------------------------------------------------------------------------
+static void kbd_wait(void)
+{
+    if(read_word(0x0040, 0x001A) != read_word(0x0040, 0x001C)) return;
+
+    __asm {
+        push  ax
+        mov   ax, 0x9002        // device busy: keyboard
+        int   0x15
+        pop   ax
+        cli
+    }
+    while(read_word(0x0040, 0x001A) == read_word(0x0040, 0x001C)) {
+        __asm {
+            sti
+#if KBD_WAIT_HLT
+            hlt
+#else
+            nop
+#endif
+            cli
+        }
+    }
+    __asm { sti }
+}
+
 //--------------------------------------------------------------------------
 //--------------------------------------------------------------------------
 // INT16 Support function - Keyboard support routine
@@ -390,9 +588,8 @@ void __cdecl int16_function(Bit16u rAX, Bit16u rCX, Bit16u rFLAGS)
 
     switch(GET_AH()) {
         case 0x00:      // read keyboard input 
-            if(!dequeue_key(&scan_code, &ascii_code, 1)) {          // if retirns a 0
-                BX_PANIC("KBD: int16h: out of keyboard input\n");   // that means no key strokes waiting
-            }
+            kbd_wait();                                             // block until a key stroke is waiting
+            dequeue_key(&scan_code, &ascii_code, 1);
             if(scan_code !=0 && ascii_code == 0xF0) ascii_code = 0;
             else if(ascii_code == 0xE0)             ascii_code = 0;
             kbd_code = (scan_code << 8) | ascii_code;
@@ -437,9 +634,8 @@ void __cdecl int16_function(Bit16u rAX, Bit16u rCX, Bit16u rFLAGS)
             break;
 
         case 0x10: // read MF-II keyboard input 
-            if(!dequeue_key(&scan_code, &ascii_code, 1) ) {
-                BX_PANIC("KBD: int16h: out of keyboard input\n");
-            }
+            kbd_wait();
+            dequeue_key(&scan_code, &ascii_code, 1);
             if(scan_code !=0 && ascii_code == 0xF0) ascii_code = 0;
             kbd_code = (scan_code << 8) | ascii_code;
             SET_AX(kbd_code);
@@ -481,37 +677,52 @@ void __cdecl int16_function(Bit16u rAX, Bit16u rCX, Bit16u rFLAGS)
 }
 
 //--------------------------------------------------------------------------
-// Enqueue Key
+// Enqueue Key - the buffer bounds are fixed at KBD_BUFFER_START/END,
+// POST points 40:80 and 40:82 at them for programs that look.
 //--------------------------------------------------------------------------
 static BOOL enqueue_key(Bit8u scan_code, Bit8u ascii_code)
 {
-    Bit16u buffer_start, buffer_end, buffer_head, buffer_tail, temp_tail;
-
-    buffer_start = read_word(0x0040, 0x0080);
-    buffer_end   = read_word(0x0040, 0x0082);
-    buffer_head  = read_word(0x0040, 0x001A);
-    buffer_tail  = read_word(0x0040, 0x001C);
+    Bit16u buffer_tail, next_tail;
 
-    temp_tail = buffer_tail;
-    buffer_tail += 2;
-    if(buffer_tail >= buffer_end) buffer_tail = buffer_start;
-    if(buffer_tail == buffer_head) return(0);   // Buffer over run
+    buffer_tail = read_word(0x0040, 0x001C);
+    next_tail   = buffer_tail + 2;
+    if(next_tail >= KBD_BUFFER_END) next_tail = KBD_BUFFER_START;
+    if(next_tail == read_word(0x0040, 0x001A)) return(0);   // Buffer over run
 
-    write_byte(0x0040, temp_tail, ascii_code);
-    write_byte(0x0040, temp_tail+1, scan_code);
-    write_word(0x0040, 0x001C, buffer_tail);
+    write_word(0x0040, buffer_tail, (scan_code << 8) | ascii_code);
+    write_word(0x0040, 0x001C, next_tail);
     return(1);
 }
 
+//--------------------------------------------------------------------------
+// Lock key that applies to a scan code, worked out from its normal entry
+// in scan_to_scanascii[]: Caps Lock (0x40) for letters, Num Lock (0x20)
+// for keypad keys with no normal ASCII code.
+//--------------------------------------------------------------------------
+static Bit8u kbd_lock_flag(Bit8u scan_code, Bit16u normal)
+{
+    Bit8u ascii_code = (Bit8u)normal;
+
+    if(ascii_code >= 'a' && ascii_code <= 'z') return(0x40);
+    if(scan_code >= 0x47 && scan_code <= 0x53 && ascii_code == 0) return(0x20);
+    return(0);
+}
+
 //--------------------------------------------------------------------------
 //--------------------------------------------------------------------------
 // INT09 Support function
+// The three BDA flag bytes are read once into locals, updated there and
+// written back once on the way out. Keys are translated with a single
+// scan_to_scanascii[scan code][state] lookup.
 //--------------------------------------------------------------------------
 //--------------------------------------------------------------------------
 void __cdecl int09_function(Bit16u rAX)
 {
-    Bit8u scancode, asciicode, shift_flags;
-    Bit8u mf2_flags, mf2_state;
+    Bit8u  scancode, shift_flags;
+    Bit8u  mf2_flags, mf2_state;
+    Bit8u  state, lock;
+    Bit16u key;
+    BOOL   posted = 0;
 
     scancode = GET_AL();    // DS has been set to F000 before call
     if(scancode == 0) {
@@ -522,183 +733,960 @@ void __cdecl int09_function(Bit16u rAX)
     shift_flags = read_byte(0x0040, 0x17);
     mf2_flags   = read_byte(0x0040, 0x18);
     mf2_state   = read_byte(0x0040, 0x96);
-    asciicode   = 0;
 
     switch(scancode) {
-        case 0x3a:              // Caps Lock press 
-            shift_flags ^= 0x40;
-            write_byte(0x0040, 0x17, shift_flags);
-            mf2_flags |= 0x40;
-            write_byte(0x0040, 0x18, mf2_flags);
-            break;
-
-        case 0xba:              // Caps Lock release 
-            mf2_flags &= ~0x40;
-            write_byte(0x0040, 0x18, mf2_flags);
-            break;
-
-        case 0x2a:              // L Shift press 
-            shift_flags |= 0x02;
-            write_byte(0x0040, 0x17, shift_flags);
-            break;
-
-        case 0xaa:              // L Shift release 
-            shift_flags &= ~0x02;
-            write_byte(0x0040, 0x17, shift_flags);
-            break;
-
-        case 0x36:              // R Shift press 
-            shift_flags |= 0x01;
-            write_byte(0x0040, 0x17, shift_flags);
-            break;
-
-        case 0xb6:              // R Shift release 
-            shift_flags &= ~0x01;
-            write_byte(0x0040, 0x17, shift_flags);
-            break;
-
-        case 0x1d:              // Ctrl press 
+        case 0x3a: shift_flags ^= 0x40; mf2_flags |=  0x40; break;     // Caps Lock press
+        case 0xba:                      mf2_flags &= ~0x40; break;     // Caps Lock release
+        case 0x2a: shift_flags |=  0x02;                    break;     // L Shift press
+        case 0xaa: shift_flags &= ~0x02;                    break;     // L Shift release
+        case 0x36: shift_flags |=  0x01;                    break;     // R Shift press
+        case 0xb6: shift_flags &= ~0x01;                    break;     // R Shift release
+        case 0x46: shift_flags ^= 0x10; mf2_flags |=  0x10; break;     // Scroll Lock press
+        case 0xc6:                      mf2_flags &= ~0x10; break;     // Scroll Lock release
+
+        case 0x1d:              // Ctrl press, ignored inside the Pause sequence
             if((mf2_state & 0x01) == 0) {
                 shift_flags |= 0x04;
-                write_byte(0x0040, 0x17, shift_flags);
-                if(mf2_state & 0x02) {
-                    mf2_state |= 0x04;
-                    write_byte(0x0040, 0x96, mf2_state);
-                }
-                else {
-                    mf2_flags |= 0x01;
-                    write_byte(0x0040, 0x18, mf2_flags);
-                }
+                if(mf2_state & 0x02) mf2_state |= 0x04;     // Right Ctrl
+                else                 mf2_flags |= 0x01;
             }
             break;
 
-        case 0x9d: // Ctrl release 
+        case 0x9d:              // Ctrl release
             if((mf2_state & 0x01) == 0) {
                 shift_flags &= ~0x04;
-                write_byte(0x0040, 0x17, shift_flags);
-                if(mf2_state & 0x02) {
-                    mf2_state &= ~0x04;
-                    write_byte(0x0040, 0x96, mf2_state);
-                }
-                else {
-                    mf2_flags &= ~0x01;
-                    write_byte(0x0040, 0x18, mf2_flags);
-                }
+                if(mf2_state & 0x02) mf2_state &= ~0x04;
+                else                 mf2_flags &= ~0x01;
             }
             break;
 
-        case 0x38: // Alt press 
+        case 0x38:              // Alt press
             shift_flags |= 0x08;
-            write_byte(0x0040, 0x17, shift_flags);
-            if(mf2_state & 0x02) {
-                mf2_state |= 0x08;
-                write_byte(0x0040, 0x96, mf2_state);
-            }
-            else {
-                mf2_flags |= 0x02;
-                write_byte(0x0040, 0x18, mf2_flags);
-            }
+            if(mf2_state & 0x02) mf2_state |= 0x08;         // Right Alt
+            else                 mf2_flags |= 0x02;
             break;
 
-        case 0xb8: // Alt release 
+        case 0xb8:              // Alt release
             shift_flags &= ~0x08;
-            write_byte(0x0040, 0x17, shift_flags);
-            if(mf2_state & 0x02) {
-                mf2_state &= ~0x08;
-                write_byte(0x0040, 0x96, mf2_state);
-            }
-            else {
-                mf2_flags &= ~0x02;
-                write_byte(0x0040, 0x18, mf2_flags);
-            }
+            if(mf2_state & 0x02) mf2_state &= ~0x08;
+            else                 mf2_flags &= ~0x02;
             break;
 
-        case 0x45: // Num Lock press 
+        case 0x45:              // Num Lock press
             if((mf2_state & 0x03) == 0) {
-                mf2_flags |= 0x20;
-                write_byte(0x0040, 0x18, mf2_flags);
+                mf2_flags   |= 0x20;
                 shift_flags ^= 0x20;
-                write_byte(0x0040, 0x17, shift_flags);
-            }
-            break;
-
-        case 0xc5: // Num Lock release 
-            if((mf2_state & 0x03) == 0) {
-                mf2_flags &= ~0x20;
-                write_byte(0x0040, 0x18, mf2_flags);
             }
             break;
 
-        case 0x46: // Scroll Lock press 
-            mf2_flags |= 0x10;
-            write_byte(0x0040, 0x18, mf2_flags);
-            shift_flags ^= 0x10;
-            write_byte(0x0040, 0x17, shift_flags);
-            break;
-
-        case 0xc6: // Scroll Lock release 
-            mf2_flags &= ~0x10;
-            write_byte(0x0040, 0x18, mf2_flags);
+        case 0xc5:              // Num Lock release
+            if((mf2_state & 0x03) == 0) mf2_flags &= ~0x20;
             break;
 
         default:
-            if(scancode & 0x80) {
-                break; // toss key releases ... 
-            }
+            if(scancode & 0x80) break;      // toss key releases ...
             if(scancode > MAX_SCAN_CODE) {
                 bios_printf(BIOS_PRINTF_INFO,"KBD: int09h_handler(): unknown scancode read: 0x%02x!\n", scancode);
-                return;
+                break;
             }
-            if(shift_flags & 0x08) { // ALT 
-                asciicode = scan_to_scanascii[scancode].alt;
-                scancode = scan_to_scanascii[scancode].alt >> 8;
+            key = scan_to_scanascii[scancode][KBD_NORMAL];
+            if(shift_flags & 0x08)      state = KBD_ALT;
+            else if(shift_flags & 0x04) state = KBD_CONTROL;
+            else if((mf2_state & 0x02) && scancode >= 0x47 && scancode <= 0x53) {
+                posted = enqueue_key(key >> 8, 0xe0);   // grey cursor keys, not affected by Num Lock
+                break;
             }
-            else if(shift_flags & 0x04) { // CONTROL 
-                asciicode = scan_to_scanascii[scancode].control;
-                scancode = scan_to_scanascii[scancode].control >> 8;
+            else {                              // a lock inverts SHIFT for the keys it covers
+                lock  = kbd_lock_flag(scancode, key);
+                state = ((shift_flags & 0x03) != 0) != ((shift_flags & lock) != 0) ? KBD_SHIFT : KBD_NORMAL;
             }
-            else if(((mf2_state & 0x02) > 0) && ((scancode >= 0x47) && (scancode <= 0x53))) {
-                asciicode = 0xe0;   // extended keys handling 
-                scancode = scan_to_scanascii[scancode].normal >> 8;
+            key = scan_to_scanascii[scancode][state];
+            if(key == none) break;              // no code for this key in this state
+            posted = enqueue_key(key >> 8, (Bit8u)key);
+            break;
+    }
+    if((scancode & 0x7f) != 0x1d) mf2_state &= ~0x01;
+    mf2_state &= ~0x02;
+    write_byte(0x0040, 0x17, shift_flags);
+    write_byte(0x0040, 0x18, mf2_flags);
+    write_byte(0x0040, 0x96, mf2_state);
+    if(posted) {
+        __asm {
+            push  ax
+            mov   ax, 0x9102    // interrupt complete: keyboard
+            int   0x15
+            pop   ax
+        }
+    }
+}
+
+//--------------------------------------------------------------------------
+//--------------------------------------------------------------------------
+// INT13 Interupt handler function
+//--------------------------------------------------------------------------
+//--------------------------------------------------------------------------
+#define SET_DISK_RET_STATUS(status) write_byte(0x0040, 0x0074, status)
+
+//--------------------------------------------------------------------------
+// SD card command: lowers /CS, sends the 6 byte command frame and returns
+// the R1 response (0xff if the card never answered). /CS is left low so
+// the caller can read the rest of an R3/R7 response or a data block.
+//--------------------------------------------------------------------------
+static Bit8u sd_command(Bit8u cmd, Bit32u arg, Bit8u crc)
+{
+    Bit8u  r1;
+    Bit16u n;
+
+    outb(SD_PORT, 0xff);                        // one idle byte between commands
+    outw(SD_PORT, 0x0040 | cmd);                // CS = 0, command byte
+    outb(SD_PORT, (Bit8u)(arg >> 24));          // arg[31:24]
+    outb(SD_PORT, (Bit8u)(arg >> 16));          // arg[23:16]
+    outb(SD_PORT, (Bit8u)(arg >>  8));          // arg[15:8]
+    outb(SD_PORT, (Bit8u)(arg      ));          // arg[7:0]
+    outb(SD_PORT, crc);                         // only checked for CMD0 and CMD8
+    for(n = 0; n < 8; n++) {                    // response comes within 8 bytes
+        r1 = inb(SD_PORT);
+        if(!(r1 & 0x80)) break;
+    }
+    return(r1);
+}
+//--------------------------------------------------------------------------
+static void sd_deselect(void)
+{
+    outb(SD_PORT, 0xff);                        // wait
+    outw(SD_PORT, 0xffff);                      // CS = 1 (disable SD)
+}
+
+//--------------------------------------------------------------------------
+// Card address of a sector: SDHC/SDXC cards take the sector number,
+// standard capacity cards take a byte address.
+//--------------------------------------------------------------------------
+static Bit32u sd_address(Bit32u log_sector)
+{
+    if(read_byte(EBDA_SEG, EBDA_SD_FLAGS) & SD_FLAG_BLOCK) return(log_sector);
+    return(log_sector << 9);
+}
+
+//--------------------------------------------------------------------------
+// Geometry the card was formatted with, so the CHS addresses in its MBR and
+// boot sectors keep naming the same sectors: the BPB of a card formatted
+// without partitions, otherwise the ending head and sectors per track of
+// one MBR partition entry, the active one or else the first used one, as
+// partitions end on a cylinder boundary. Sector 0 is read into the boot
+// sector area, INT19 loads it again later.
+// Returns heads << 8 | sectors, or 0 for a blank or unreadable card.
+//--------------------------------------------------------------------------
+static Bit16u sd_disk_geometry(void)
+{
+    Bit16u heads, sectors, entry, part;
+    Bit8u  jump;
+
+    if(sd_read_sectors(0, 1, 0, SD_GEOMETRY_SEG, 0) != 1) return(0);
+    if(read_word(SD_GEOMETRY_SEG, 0x01fe) != 0xaa55) return(0);
+
+    heads   = 0;
+    sectors = 0;
+    jump    = read_byte(SD_GEOMETRY_SEG, 0x0000);
+    if((jump == 0xeb || jump == 0xe9) && read_word(SD_GEOMETRY_SEG, 0x000b) == SECTOR_SIZE) {
+        sectors = read_word(SD_GEOMETRY_SEG, 0x0018);   // BPB sectors per track
+        heads   = read_word(SD_GEOMETRY_SEG, 0x001a);   // BPB heads
+    }
+    else {
+        part = 0;
+        for(entry = 0x01be; entry < 0x01fe; entry += 16) {
+            if(read_byte(SD_GEOMETRY_SEG, entry + 4) == 0) continue;   // unused entry
+            if(part == 0) part = entry;
+            if(read_byte(SD_GEOMETRY_SEG, entry) & 0x80) {              // active, use this one
+                part = entry;
+                break;
             }
-            else if(shift_flags & 0x03) { // LSHIFT + RSHIFT 
-                // check if lock state should be ignored  because a SHIFT key are pressed 
-                if(shift_flags & scan_to_scanascii[scancode].lock_flags) {
-                    asciicode = scan_to_scanascii[scancode].normal;
-                    scancode = scan_to_scanascii[scancode].normal >> 8;
-                }
-                else {
-                    asciicode = scan_to_scanascii[scancode].shift;
-                    scancode = scan_to_scanascii[scancode].shift >> 8;
-                }
+        }
+        if(part) {                                                      // ending CHS, one entry
+            heads   = read_byte(SD_GEOMETRY_SEG, part + 5) + 1;         // so both match
+            sectors = read_byte(SD_GEOMETRY_SEG, part + 6) & 0x3f;
+        }
+    }
+    if(heads == 0 || heads > 255 || sectors == 0 || sectors > 63) return(0);
+    return((heads << 8) | sectors);
+}
+
+//--------------------------------------------------------------------------
+// Drive C: geometry. A formatted card keeps the geometry found by
+// sd_disk_geometry(); a blank one gets the usual LBA assist translation:
+// 63 sectors per track and the fewest heads (16, 32, 64, 128 or 255) that
+// fit the card in 1024 cylinders.
+//--------------------------------------------------------------------------
+static void sd_set_geometry(Bit32u total)
+{
+    Bit16u heads, sectors, geometry;
+    Bit32u cylinders;
+
+    if(SD_DETECT_GEOMETRY && total) {
+        geometry = sd_disk_geometry();
+        if(geometry) {
+            heads   = geometry >> 8;
+            sectors = geometry & 0x00ff;
+        }
+        else {
+            sectors = HD_SECTORS;
+            for(heads = 16; heads < 255; heads <<= 1) {
+                if(total <= (Bit32u)heads * HD_SECTORS * 1024) break;
             }
-            else {         // check if lock is on 
-            if(shift_flags & scan_to_scanascii[scancode].lock_flags) {
-                asciicode = scan_to_scanascii[scancode].shift;
-                scancode = scan_to_scanascii[scancode].shift >> 8;
+            if(heads > 255) heads = 255;
+        }
+        cylinders = total / ((Bit32u)heads * sectors);
+        if(cylinders > 1024) cylinders = 1024;
+    }
+    else {                                      // unknown size, use the old fixed geometry
+        heads     = HD_HEADS;
+        sectors   = HD_SECTORS;
+        cylinders = HD_CYLINDERS;
+    }
+    write_byte(EBDA_SEG, EBDA_SD_HEADS,     (Bit8u)heads);
+    write_word(EBDA_SEG, EBDA_SD_CYLINDERS, (Bit16u)cylinders);
+    write_byte(EBDA_SEG, EBDA_SD_SECTORS,   (Bit8u)sectors);
+    write_word(EBDA_SEG, EBDA_SD_TOTAL,     (Bit16u)total);
+    write_word(EBDA_SEG, EBDA_SD_TOTAL + 2, (Bit16u)(total >> 16));
+}
+
+//--------------------------------------------------------------------------
+// SD card initialization: brings the card into SPI mode (CMD0), identifies
+// it (CMD8, ACMD41 with HCS, CMD1 for MMC) and reads the OCR (CMD58) to
+// choose block or byte addressing. Used at POST and to revive a card that
+// stopped answering. Returns the error stage (0 = ok):
+//   1 = no response to CMD0, 2 = CMD16 failed, 3 = card did not leave idle
+//--------------------------------------------------------------------------
+static Bit8u sd_card_init(void)
+{
+    Bit8u  r1, v2, flags;
+    Bit16u n;
+
+    flags = 0;
+    outw(SD_PORT, 0xffff);                      // CS = 1
+    for(n = 0; n < 10; n++) outb(SD_PORT, 0xff);    // 80 cycles of initialization
+
+    r1 = sd_command(0, 0, 0x95);                // CMD0: reset the SD card
+    sd_deselect();
+    if(r1 != 0x01) return(1);                   // error 1
+
+    v2 = 0;
+    r1 = sd_command(8, 0x000001AAL, 0x87);      // CMD8: 2.7-3.6V, check pattern 0xAA
+    if(r1 == 0x01) {                            // version 2 card, R7 follows
+        inb(SD_PORT);
+        inb(SD_PORT);
+        if((inb(SD_PORT) & 0x0f) == 0x01 && inb(SD_PORT) == 0xAA) v2 = 1;
+    }
+    sd_deselect();
+
+    for(n = 0; n < SD_INIT_TRIES; n++) {        // ACMD41 until the card leaves idle
+        sd_command(55, 0, 0xff);                // CMD55: application command follows
+        sd_deselect();
+        r1 = sd_command(41, v2 ? 0x40000000L : 0, 0xff);    // ACMD41, HCS for v2 cards
+        sd_deselect();
+        if(r1 != 0x01) break;
+    }
+    if(r1 & 0x04) {                             // illegal command: MMC, use CMD1
+        for(n = 0; n < SD_INIT_TRIES; n++) {
+            r1 = sd_command(1, 0, 0xff);        // CMD1: activate the init sequence
+            sd_deselect();
+            if(r1 != 0x01) break;
+        }
+    }
+    if(r1 != 0) return(3);                      // error 3
+
+    if(v2) {
+        r1 = sd_command(58, 0, 0xff);           // CMD58: read the OCR
+        if(r1 == 0 && (inb(SD_PORT) & 0x40)) flags |= SD_FLAG_BLOCK;    // CCS: SDHC/SDXC
+        inb(SD_PORT);
+        inb(SD_PORT);
+        inb(SD_PORT);
+        sd_deselect();
+    }
+    write_byte(EBDA_SEG, EBDA_SD_FLAGS, flags);
+
+    if(!(flags & SD_FLAG_BLOCK)) {              // byte addressed cards
+        r1 = sd_command(16, 512, 0xff);         // CMD16: set block length
+        sd_deselect();
+        if(r1 != 0) return(2);                  // error 2
+    }
+    return(0);
+}
+
+//--------------------------------------------------------------------------
+//--------------------------------------------------------------------------
+// SD card POST - called from hard_drive_post in zetbios_a.asm
+// Initializes the card with sd_card_init(), reads the CSD (CMD9) for the
+// capacity, then sets the drive C: geometry. Failures are recorded in
+// 40:8D (0 = ok), see sd_card_init() for the error stages.
+//--------------------------------------------------------------------------
+//--------------------------------------------------------------------------
+void __cdecl sd_card_post(void)
+{
+    Bit8u  error, csd[16];
+    Bit8u  read_bl_len, c_size_mult;
+    Bit16u n;
+    Bit32u total, c_size;
+
+    total = 0;
+    write_byte(EBDA_SEG, EBDA_SD_FLAGS, 0);
+    write_byte(EBDA_SEG, EBDA_SD_STATUS, 0);
+    sd_set_geometry(0);
+#if SD_CACHE
+    sd_cache_init();
+#endif
+
+    error = sd_card_init();
+    if(error) {
+        write_byte(0x0040, 0x008d, error);
+        return;
+    }
+
+    if(sd_command(9, 0, 0xff) == 0) {           // CMD9: read the CSD register
+        for(n = 0; n < 0x1000; n++) {           // data token: 0xfe
+            if(inb(SD_PORT) == 0xfe) break;
+        }
+        if(n < 0x1000) {
+            for(n = 0; n < 16; n++) csd[n] = inb(SD_PORT);
+            inb(SD_PORT);                       // CRC
+            inb(SD_PORT);
+            if((csd[0] >> 6) == 1) {            // CSD 2.0: capacity = (C_SIZE+1) * 512K
+                c_size = ((Bit32u)(csd[7] & 0x3f) << 16) | ((Bit16u)csd[8] << 8) | csd[9];
+                total  = (c_size + 1) << 10;
             }
-            else {
-                asciicode = scan_to_scanascii[scancode].normal;
-                scancode = scan_to_scanascii[scancode].normal >> 8;
+            else {                              // CSD 1.0: (C_SIZE+1) << (C_SIZE_MULT+2+READ_BL_LEN)
+                read_bl_len = csd[5] & 0x0f;
+                c_size      = ((Bit16u)(csd[6] & 0x03) << 10) | ((Bit16u)csd[7] << 2) | (csd[8] >> 6);
+                c_size_mult = ((csd[9] & 0x03) << 1) | (csd[10] >> 7);
+                total       = (c_size + 1) << (c_size_mult + 2 + read_bl_len - 9);
             }
         }
-        if(scancode==0 && asciicode==0) {
-            BX_INFO("KBD: int09h_handler(): scancode & asciicode are zero?\n");
+    }
+    sd_deselect();
+
+    sd_set_geometry(total);
+    BX_INFO("SD card: %lu sectors, %s addressing\n", total,
+            (read_byte(EBDA_SEG, EBDA_SD_FLAGS) & SD_FLAG_BLOCK) ? "block" : "byte");
+}
+
+//--------------------------------------------------------------------------
+// Bounded waits on the card, timed with the BDA tick counter at 40:6C so
+// a card that stops answering can no longer hang the machine. Interrupts
+// must be enabled. Both return 0 or an INT13 status.
+//--------------------------------------------------------------------------
+static Bit8u sd_wait_ready(void)
+{
+    Bit16u start;
+
+    start = read_word(0x0040, 0x006c);
+    while(inb(SD_PORT) == 0) {                  // card holds the line low while busy
+        if(read_word(0x0040, 0x006c) - start > SD_TIMEOUT_TICKS) return(0x80);  // time out
+    }
+    return(0);
+}
+//--------------------------------------------------------------------------
+static Bit8u sd_wait_token(void)
+{
+    Bit16u start;
+    Bit8u  token;
+
+    start = read_word(0x0040, 0x006c);
+    while((token = inb(SD_PORT)) == 0xff) {
+        if(read_word(0x0040, 0x006c) - start > SD_TIMEOUT_TICKS) return(0x80);  // time out
+    }
+    if(token != 0xfe) return(0x10);             // data error token: bad sector
+    return(0);
+}
+
+//--------------------------------------------------------------------------
+// Back off before retry n: wait 2^n ticks and, once a retry has failed,
+// bring the card back up with CMD0/CMD8/ACMD41 before trying again.
+//--------------------------------------------------------------------------
+static void sd_recover(Bit16u tries)
+{
+    Bit16u start;
+
+    sd_deselect();
+    start = read_word(0x0040, 0x006c);
+    while(read_word(0x0040, 0x006c) - start < (1 << tries));
+    if(tries >= SD_REINIT_AFTER) sd_card_init();
+}
+
+//--------------------------------------------------------------------------
+// SD card block read:
+// With SD_MULTI_BLOCK a single CMD18 (READ_MULTIPLE_BLOCK) covers the whole
+// request and is ended with CMD12 (STOP_TRANSMISSION), /CS is only raised
+// once at the end. Otherwise every block is its own CMD17. count sectors
+// are streamed into s_segment:s_offset, each block preceded by its 0xFE
+// data token. The destination is normalized before every block so
+// transfers may cross any number of 64K boundaries. The ahead sectors
+// following the request are read in the same burst into the read-ahead
+// staging area behind the cache tags (EMS page 2, mapped by the caller).
+// Returns the number of sectors transferred, including the read-ahead,
+// and leaves 0 or the INT13 error in EBDA_SD_STATUS.
+//--------------------------------------------------------------------------
+static Bit16u sd_read_blocks(Bit32u log_sector, Bit16u count, Bit16u ahead, Bit16u s_segment, Bit16u s_offset)
+{
+    Bit16u done;
+    Bit8u  r1, status;
+
+    count += ahead;
+    status = 0;
+    done   = 0;
+#if SD_MULTI_BLOCK
+    r1 = sd_command(18, sd_address(log_sector), 0xff);  // CMD18: read multiple blocks
+    if(r1) status = (r1 == 0xff) ? 0x80 : 0x04;         // no response / sector not found
+#endif
+
+    for( ; !status && done < count; done++) {
+        if(done == count - ahead) {             // read-ahead goes to the staging page
+            s_segment = EMS_SECTOR_OFFSET;
+            s_offset  = SD_AHEAD_OFFSET;
+        }
+#if !SD_MULTI_BLOCK
+        r1 = sd_command(17, sd_address(log_sector + done), 0xff);  // CMD17: read one block
+        if(r1) {
+            status = (r1 == 0xff) ? 0x80 : 0x04;
+            break;
+        }
+#endif
+        status = sd_wait_token();               // data token: 0xfe
+        if(status) break;
+
+        __asm {
+                    push  ax
+                    push  cx
+                    push  dx
+                    push  di
+                    push  es
+                    mov   ax, s_offset      // normalize ES:DI so the block
+                    mov   di, ax            // can never wrap the offset
+                    and   di, 0x000f        // DI: destination offset
+                    mov   cl, 4
+                    shr   ax, cl
+                    add   ax, s_segment
+                    mov   es, ax            // ES: destination segment
+                    mov   dx, 0x0100        // SD card IO Port
+                    mov   cx, 0x100
+#if SD_WORD_PORT
+                    inc   dx                // control port 0x101
+                    mov   al, 0x02          // CS = 0, word mode
+                    out   dx, al
+                    dec   dx
+                    cld
+
+    sd_rb_read_words:
+                    in    ax, dx            // two bytes, low byte first
+                    stosw
+                    loop  sd_rb_read_words
+
+                    inc   dx                // control port 0x101
+                    xor   al, al            // CS = 0, byte mode
+                    out   dx, al
+                    dec   dx
+#else
+    sd_rb_read_bytes:
+                    in    al, dx            // low byte
+                    mov   ah, al
+                    in    al, dx            // high byte
+                    xchg  al, ah
+                    mov   word ptr es:[di], ax
+                    add   di, 2
+                    loop  sd_rb_read_bytes
+#endif
+
+                    mov   al, 0xff          // Checksum, 2 bytes (not used)
+                    out   dx, al
+                    out   dx, al
+
+                    mov   s_offset, di      // keep ES:DI for the next block
+                    mov   s_segment, es
+                    pop   es
+                    pop   di
+                    pop   dx
+                    pop   cx
+                    pop   ax
+        }
+#if !SD_MULTI_BLOCK
+        sd_deselect();
+#endif
+    }
+
+#if SD_MULTI_BLOCK
+    if(r1 == 0) {                               // stream was started, stop it
+        Bit16u n;
+
+        outb(SD_PORT, 0x4c);                    // command CMD12, stop transmission
+        outb(SD_PORT, 0);                       // 32-bit zero argument
+        outb(SD_PORT, 0);
+        outb(SD_PORT, 0);
+        outb(SD_PORT, 0);
+        outb(SD_PORT, 0xff);                    // CRC (not used)
+        inb(SD_PORT);                           // stuff byte
+        for(r1 = 0xff, n = 0; n < 8 && (r1 & 0x80); n++) r1 = inb(SD_PORT);
+        if(r1 & 0x80) r1 = 0x80;                // R1 never came
+        else          r1 = sd_wait_ready();     // card holds the line low while busy
+        if(!status) status = r1;
+    }
+#endif
+    sd_deselect();
+    write_byte(EBDA_SEG, EBDA_SD_STATUS, status);
+    return(done);
+}
+
+//--------------------------------------------------------------------------
+// SD card block write:
+// With SD_MULTI_BLOCK a single CMD25 (WRITE_MULTIPLE_BLOCK) sends count
+// sectors from s_segment:s_offset, each with the 0xFC start token. Between
+// blocks we only wait for the card to take the data (its write buffer
+// frees up quickly); the long programming busy is waited for once, after
+// the 0xFD stop tran token. Otherwise every block is its own CMD24 with
+// the 0xFE token, followed by its programming busy. If the card rejects a
+// block the transfer is stopped there.
+// Returns the number of sectors accepted by the card and leaves 0 or the
+// INT13 error in EBDA_SD_STATUS.
+//--------------------------------------------------------------------------
+static Bit16u sd_write_blocks(Bit32u log_sector, Bit16u count, Bit16u s_segment, Bit16u s_offset)
+{
+    Bit16u done;
+    Bit8u  r1, status, response;
+
+    status = 0;
+    done   = 0;
+#if SD_MULTI_BLOCK
+    r1 = sd_command(25, sd_address(log_sector), 0xff);  // CMD25: write multiple blocks
+    if(r1) status = (r1 == 0xff) ? 0x80 : 0xcc;         // no response / write fault
+#endif
+
+    for( ; !status && done < count; done++) {
+#if !SD_MULTI_BLOCK
+        r1 = sd_command(24, sd_address(log_sector + done), 0xff);  // CMD24: write one block
+        if(r1) {
+            status = (r1 == 0xff) ? 0x80 : 0xcc;
+            break;
         }
-        enqueue_key(scancode, asciicode);
-        break;
+#endif
+        __asm {
+                    push  ax
+                    push  cx
+                    push  dx
+                    push  si
+                    push  ds
+                    mov   ax, s_offset      // normalize DS:SI so the block
+                    mov   si, ax            // can never wrap the offset
+                    and   si, 0x000f        // SI: source offset
+                    mov   cl, 4
+                    shr   ax, cl
+                    add   ax, s_segment
+                    mov   s_segment, ax     // keep DS:SI for the next block
+                    mov   ds, ax            // DS: source segment
+                    mov   dx, 0x0100        // SD card IO Port
+                    mov   al, 0xff          // wait
+                    out   dx, al
+#if SD_MULTI_BLOCK
+                    mov   al, 0xfc          // start of block: multi-block token 0xfc
+#else
+                    mov   al, 0xfe          // start of block: token 0xfe
+#endif
+                    out   dx, al
+                    mov   cx, 0x100
+                    cld
+#if SD_WORD_PORT
+                    inc   dx                // control port 0x101
+                    mov   al, 0x02          // CS = 0, word mode
+                    out   dx, al
+                    dec   dx
+
+    sd_wb_write_words:
+                    lodsw
+                    out   dx, ax            // two bytes, low byte first
+                    loop  sd_wb_write_words
+
+                    inc   dx                // control port 0x101
+                    xor   al, al            // CS = 0, byte mode
+                    out   dx, al
+                    dec   dx
+#else
+    sd_wb_write_bytes:
+                    lodsw
+                    out   dx, al
+                    mov   al, ah
+                    out   dx, al
+                    loop  sd_wb_write_bytes
+#endif
+
+                    mov   al, 0xff          // send dummy checksum
+                    out   dx, al
+                    out   dx, al
+                    in    al, dx            // data response: xxx0sss1
+                    and   al, 0x1f
+                    mov   cl, al
+
+                    mov   ax, si
+                    pop   ds
+                    mov   s_offset, ax
+                    mov   response, cl
+                    pop   si
+                    pop   dx
+                    pop   cx
+                    pop   ax
+        }
+        if(response != 0x05) {                  // data rejected (CRC or write error)
+            status = 0xcc;
+            break;
+        }
+        status = sd_wait_ready();               // until the card takes the block
+        if(status) break;
+#if !SD_MULTI_BLOCK
+        sd_deselect();
+#endif
+    }
+
+#if SD_MULTI_BLOCK
+    if(r1 == 0) {                               // stream was started, stop it
+        outb(SD_PORT, 0xfd);                    // stop tran token
+        outb(SD_PORT, 0xff);                    // stuff byte
+        r1 = sd_wait_ready();                   // card holds the line low while programming
+        if(!status) status = r1;
+    }
+#endif
+    sd_deselect();
+    write_byte(EBDA_SEG, EBDA_SD_STATUS, status);
+    return(done);
+}
+
+//--------------------------------------------------------------------------
+// Drive C: sector transfers: a failed transfer is resumed at the first
+// sector that did not make it, up to SD_RETRIES times with sd_recover()
+// in between. The read-ahead part of a read is never retried.
+// Return the number of sectors transferred, 0 or the INT13 error of the
+// last attempt is left in EBDA_SD_STATUS.
+//--------------------------------------------------------------------------
+static Bit16u sd_read_sectors(Bit32u log_sector, Bit16u count, Bit16u ahead, Bit16u s_segment, Bit16u s_offset)
+{
+    Bit16u done, tries;
+
+    if(count == 0) return(0);
+    s_segment += s_offset >> 4;                 // normalize, sector n is then
+    s_offset  &= 0x000f;                        // at s_segment + n * 0x20
+
+    done = 0;
+    for(tries = 0; ; tries++) {
+        done += sd_read_blocks(log_sector + done, count - done, ahead, s_segment + (done << 5), s_offset);
+        if(done >= count || tries == SD_RETRIES) break;
+        sd_recover(tries);
+    }
+    return(done);
+}
+//--------------------------------------------------------------------------
+static Bit16u sd_write_sectors(Bit32u log_sector, Bit16u count, Bit16u s_segment, Bit16u s_offset)
+{
+    Bit16u done, tries;
+
+    if(count == 0) return(0);
+    s_segment += s_offset >> 4;
+    s_offset  &= 0x000f;
+
+    done = 0;
+    for(tries = 0; ; tries++) {
+        done += sd_write_blocks(log_sector + done, count - done, s_segment + (done << 5), s_offset);
+        if(done >= count || tries == SD_RETRIES) break;
+        sd_recover(tries);
+    }
+    return(done);
+}
+
+//--------------------------------------------------------------------------
+// Number of sectors the INT13 extensions expose: the card capacity read
+// from the CSD, or the CHS size if the CSD could not be read.
+//--------------------------------------------------------------------------
+static Bit32u edd_total_sectors(void)
+{
+    Bit32u total;
+    total = ((Bit32u)read_word(EBDA_SEG, EBDA_SD_TOTAL + 2) << 16) | read_word(EBDA_SEG, EBDA_SD_TOTAL);
+    if(total == 0) {
+        total = (Bit32u)read_word(EBDA_SEG, EBDA_SD_CYLINDERS)
+              * read_byte(EBDA_SEG, EBDA_SD_HEADS) * read_byte(EBDA_SEG, EBDA_SD_SECTORS);
+    }
+    return(total);
+}
+
+#if SD_CACHE
+//--------------------------------------------------------------------------
+//--------------------------------------------------------------------------
+// SD sector cache:
+// A set associative cache of drive C: sectors kept in SDRAM above the RAM
+// disk. Sector n lives in set (n & (SD_CACHE_SETS-1)); each set holds
+// SD_CACHE_WAYS sectors replaced least recently used first. The data pages
+// are mapped through EMS page 1 like the RAM disk, the tag directory and
+// the read-ahead staging area behind it stay mapped through EMS page 2;
+// pages 3 and 4 (B8000) are left alone, VGA text memory decodes there.
+// Every tag is 8 bytes:
+//   00 u32 sector number   04 u8 flags (SD_CACHE_xxx)   05 u8 age (0 = newest)
+// Write-through by default; with SD_CACHE_WRITE_BACK dirty sectors stay in
+// SDRAM until evicted or flushed by INT13 AH=00 / INT19.
+//--------------------------------------------------------------------------
+//--------------------------------------------------------------------------
+static void sd_cache_init(void)
+{
+    Bit16u entry;
+
+    outb(EMS_ENABLE_REG, EMS_ENABLE_VAL);       // Turn on EMS from 0xB0000 - 0xBFFFF
+    outb(EMS_PAGE2_REG, SD_CACHE_TAG_PAGE);
+    for(entry = 0; entry < SD_CACHE_ENTRIES; entry++) {
+        write_word(EMS_SECTOR_OFFSET, SD_CACHE_TAG(entry),     0);
+        write_word(EMS_SECTOR_OFFSET, SD_CACHE_TAG(entry) + 2, 0);
+        write_byte(EMS_SECTOR_OFFSET, SD_CACHE_TAG(entry) + 4, 0);
+        write_byte(EMS_SECTOR_OFFSET, SD_CACHE_TAG(entry) + 5, entry & (SD_CACHE_WAYS - 1));
+    }
+    memsetb(EBDA_SEG, EBDA_SD_CACHE_HITS, 0, 8);    // hit and miss counters
+    memsetb(EBDA_SEG, EBDA_SD_NEXT, 0, 5);          // no sequential run yet
+}
+//--------------------------------------------------------------------------
+static void sd_cache_count(Bit16u counter)
+{
+    Bit16u low;
+
+    low = read_word(EBDA_SEG, counter) + 1;
+    write_word(EBDA_SEG, counter, low);
+    if(low == 0) write_word(EBDA_SEG, counter + 2, read_word(EBDA_SEG, counter + 2) + 1);
+}
+//--------------------------------------------------------------------------
+// Map the page holding a cache entry and return its offset in the window
+//--------------------------------------------------------------------------
+static Bit16u sd_cache_map(Bit16u entry)
+{
+    outb(EMS_PAGE1_REG, SD_CACHE_BASE + (entry >> 5));
+    return((entry & 0x001F) << 9);
+}
+//--------------------------------------------------------------------------
+static Bit16u sd_cache_lookup(Bit32u log_sector)
+{
+    Bit16u first, way, tag;
+
+    first = ((Bit16u)log_sector & (SD_CACHE_SETS - 1)) * SD_CACHE_WAYS;
+    for(way = 0; way < SD_CACHE_WAYS; way++) {
+        tag = SD_CACHE_TAG(first + way);
+        if((read_byte(EMS_SECTOR_OFFSET, tag + 4) & SD_CACHE_VALID)
+           && read_word(EMS_SECTOR_OFFSET, tag)     == (Bit16u) log_sector
+           && read_word(EMS_SECTOR_OFFSET, tag + 2) == (Bit16u)(log_sector >> 16)) return(first + way);
+    }
+    return(SD_CACHE_NONE);
+}
+//--------------------------------------------------------------------------
+// Make entry the newest of its set, everything younger ages by one
+//--------------------------------------------------------------------------
+static void sd_cache_touch(Bit16u entry)
+{
+    Bit16u tag, way;
+    Bit8u  age, a;
+
+    age = read_byte(EMS_SECTOR_OFFSET, SD_CACHE_TAG(entry) + 5);
+    tag = SD_CACHE_TAG(entry & ~(SD_CACHE_WAYS - 1));
+    for(way = 0; way < SD_CACHE_WAYS; way++, tag += 8) {
+        a = read_byte(EMS_SECTOR_OFFSET, tag + 5);
+        if(a < age) write_byte(EMS_SECTOR_OFFSET, tag + 5, a + 1);
+    }
+    write_byte(EMS_SECTOR_OFFSET, SD_CACHE_TAG(entry) + 5, 0);
+}
+//--------------------------------------------------------------------------
+// Write a dirty entry back to the card. Returns 0 or the INT13 error.
+//--------------------------------------------------------------------------
+static Bit8u sd_cache_clean(Bit16u entry)
+{
+    Bit16u tag, ram;
+    Bit8u  flags;
+    Bit32u log_sector;
+
+    tag   = SD_CACHE_TAG(entry);
+    flags = read_byte(EMS_SECTOR_OFFSET, tag + 4);
+    if(!(flags & SD_CACHE_DIRTY)) return(0);
+
+    log_sector = ((Bit32u)read_word(EMS_SECTOR_OFFSET, tag + 2) << 16) | read_word(EMS_SECTOR_OFFSET, tag);
+    ram = sd_cache_map(entry);
+    if(sd_write_sectors(log_sector, 1, EMS_SECTOR_OFFSET, ram) != 1) return(read_byte(EBDA_SEG, EBDA_SD_STATUS));
+    write_byte(EMS_SECTOR_OFFSET, tag + 4, flags & ~SD_CACHE_DIRTY);
+    return(0);
+}
+//--------------------------------------------------------------------------
+// Pick the way a new sector goes to: a free one, else the least recently
+// used, written back first if dirty. SD_CACHE_NONE if that write failed.
+//--------------------------------------------------------------------------
+static Bit16u sd_cache_victim(Bit32u log_sector)
+{
+    Bit16u first, way, entry;
+
+    first = ((Bit16u)log_sector & (SD_CACHE_SETS - 1)) * SD_CACHE_WAYS;
+    entry = first;
+    for(way = 0; way < SD_CACHE_WAYS; way++) {
+        if(!(read_byte(EMS_SECTOR_OFFSET, SD_CACHE_TAG(first + way) + 4) & SD_CACHE_VALID)) return(first + way);
+        if(read_byte(EMS_SECTOR_OFFSET, SD_CACHE_TAG(first + way) + 5) == SD_CACHE_WAYS - 1) entry = first + way;
+    }
+    if(sd_cache_clean(entry)) return(SD_CACHE_NONE);
+    return(entry);
+}
+//--------------------------------------------------------------------------
+// Copy one sector from s_segment:s_offset into the cache. flags is
+// SD_CACHE_DIRTY for a write-back, 0 when the card already has the data.
+//--------------------------------------------------------------------------
+static BOOL sd_cache_fill(Bit32u log_sector, Bit16u s_segment, Bit16u s_offset, Bit8u flags)
+{
+    Bit16u entry, ram;
+
+    entry = sd_cache_lookup(log_sector);
+    if(entry == SD_CACHE_NONE) {
+        entry = sd_cache_victim(log_sector);
+        if(entry == SD_CACHE_NONE) return(0);
+        write_word(EMS_SECTOR_OFFSET, SD_CACHE_TAG(entry),     (Bit16u) log_sector);
+        write_word(EMS_SECTOR_OFFSET, SD_CACHE_TAG(entry) + 2, (Bit16u)(log_sector >> 16));
+        write_byte(EMS_SECTOR_OFFSET, SD_CACHE_TAG(entry) + 4, 0);
+    }
+    ram = sd_cache_map(entry);
+    memcpyb(EMS_SECTOR_OFFSET, ram, s_segment, s_offset, SECTOR_SIZE);
+    flags |= read_byte(EMS_SECTOR_OFFSET, SD_CACHE_TAG(entry) + 4) | SD_CACHE_VALID;
+    write_byte(EMS_SECTOR_OFFSET, SD_CACHE_TAG(entry) + 4, flags);
+    sd_cache_touch(entry);
+    return(1);
+}
+//--------------------------------------------------------------------------
+// Write every dirty sector back to the card. Returns 0 or the INT13 error.
+//--------------------------------------------------------------------------
+static Bit8u sd_cache_flush(void)
+{
+    Bit8u  status = 0;
+#if SD_CACHE_WRITE_BACK
+    Bit8u  error;
+    Bit16u entry;
+
+    outb(EMS_PAGE2_REG, SD_CACHE_TAG_PAGE);
+    for(entry = 0; entry < SD_CACHE_ENTRIES; entry++) {
+        error = sd_cache_clean(entry);
+        if(error) status = error;               // keep going, report the last failure
+    }
+#endif
+    return(status);
+}
+//--------------------------------------------------------------------------
+// Read-ahead size for a request: 0 unless it starts where the last one
+// ended, then SD_AHEAD_MIN doubling on every further sequential request up
+// to SD_AHEAD_MAX. Stops at the end of the card and at the first sector
+// already cached, so a dirty sector is never replaced by the card's copy.
+//--------------------------------------------------------------------------
+static Bit16u sd_cache_ahead(Bit32u log_sector, Bit16u count)
+{
+    Bit16u ahead;
+#if SD_READ_AHEAD
+    Bit16u n;
+    Bit32u next, total;
+#endif
+
+    ahead = 0;
+#if SD_READ_AHEAD
+    next  = ((Bit32u)read_word(EBDA_SEG, EBDA_SD_NEXT + 2) << 16) | read_word(EBDA_SEG, EBDA_SD_NEXT);
+    if(log_sector == next) {
+        ahead = read_byte(EBDA_SEG, EBDA_SD_AHEAD) << 1;
+        if(ahead < SD_AHEAD_MIN) ahead = SD_AHEAD_MIN;
+        if(ahead > SD_AHEAD_MAX) ahead = SD_AHEAD_MAX;
+    }
+    write_byte(EBDA_SEG, EBDA_SD_AHEAD, ahead);
+    next = log_sector + count;
+    write_word(EBDA_SEG, EBDA_SD_NEXT,     (Bit16u) next);
+    write_word(EBDA_SEG, EBDA_SD_NEXT + 2, (Bit16u)(next >> 16));
+
+    total = edd_total_sectors();
+    if(next >= total)              ahead = 0;
+    else if(total - next < ahead)  ahead = (Bit16u)(total - next);
+    for(n = 0; n < ahead; n++) {
+        if(sd_cache_lookup(next + n) != SD_CACHE_NONE) break;
     }
-    if((scancode & 0x7f) != 0x1d) mf2_state &= ~0x01;
-    mf2_state &= ~0x02;
-    write_byte(0x0040, 0x96, mf2_state);
+    ahead = n;
+#endif
+    return(ahead);
 }
-
 //--------------------------------------------------------------------------
+// Cached read: hits are copied out of SDRAM, each run of misses is read
+// from the card with one CMD18 straight into the caller's buffer and then
+// copied into the cache. A miss that runs to the end of a sequential
+// request carries on into the read-ahead, which only goes to the cache.
+// Returns the number of sectors transferred.
 //--------------------------------------------------------------------------
-// INT13 Interupt handler function
+static Bit16u sd_cache_read(Bit32u log_sector, Bit16u count, Bit16u s_segment, Bit16u s_offset)
+{
+    Bit16u done, run, got, ahead, j, entry, ram;
+    Bit8u  status;
+
+    s_segment += s_offset >> 4;                 // normalize, sector n is then
+    s_offset  &= 0x000f;                        // at s_segment + n * 0x20
+    outb(EMS_PAGE2_REG, SD_CACHE_TAG_PAGE);
+    ahead = sd_cache_ahead(log_sector, count);
+
+    done = 0;
+    while(done < count) {
+        entry = sd_cache_lookup(log_sector + done);
+        if(entry != SD_CACHE_NONE) {            // hit
+            ram = sd_cache_map(entry);
+            memcpyb(s_segment + (done << 5), s_offset, EMS_SECTOR_OFFSET, ram, SECTOR_SIZE);
+            sd_cache_touch(entry);
+            sd_cache_count(EBDA_SD_CACHE_HITS);
+            done++;
+            continue;
+        }
+        for(run = 1; done + run < count; run++) {   // extend the miss up to the next hit
+            if(sd_cache_lookup(log_sector + done + run) != SD_CACHE_NONE) break;
+        }
+        if(done + run < count) ahead = 0;       // only the last run reads ahead
+        got    = sd_read_sectors(log_sector + done, run, ahead, s_segment + (done << 5), s_offset);
+        status = read_byte(EBDA_SEG, EBDA_SD_STATUS);
+        for(j = run; j < got; j++) {            // staged read-ahead into the cache
+            sd_cache_fill(log_sector + done + j, EMS_SECTOR_OFFSET, SD_AHEAD_OFFSET + ((j - run) << 9), 0);
+        }
+        if(got > run) got = run;
+        for(j = 0; j < got; j++) {
+            sd_cache_fill(log_sector + done + j, s_segment + ((done + j) << 5), s_offset, 0);
+            sd_cache_count(EBDA_SD_CACHE_MISSES);
+        }
+        done += got;
+        if(got != run) {                        // a write-back in the fills may have
+            write_byte(EBDA_SEG, EBDA_SD_STATUS, status);   // overwritten the status
+            break;
+        }
+    }
+    return(done);
+}
 //--------------------------------------------------------------------------
+// Cached write: write-through sends the request to the card with one CMD25
+// and then updates the cache; write-back only marks the sectors dirty.
+// Returns the number of sectors written.
 //--------------------------------------------------------------------------
-#define SET_DISK_RET_STATUS(status) write_byte(0x0040, 0x0074, status)
+static Bit16u sd_cache_write(Bit32u log_sector, Bit16u count, Bit16u s_segment, Bit16u s_offset)
+{
+    Bit16u done;
+#if !SD_CACHE_WRITE_BACK
+    Bit16u j;
+#endif
+
+    s_segment += s_offset >> 4;
+    s_offset  &= 0x000f;
+    outb(EMS_PAGE2_REG, SD_CACHE_TAG_PAGE);
+
+#if SD_CACHE_WRITE_BACK
+    for(done = 0; done < count; done++) {
+        if(sd_cache_fill(log_sector + done, s_segment + (done << 5), s_offset, SD_CACHE_DIRTY)) continue;
+        if(sd_write_sectors(log_sector + done, 1, s_segment + (done << 5), s_offset) != 1) break;
+    }
+#else
+    done = sd_write_sectors(log_sector, count, s_segment, s_offset);
+    for(j = 0; j < done; j++) {
+        sd_cache_fill(log_sector + j, s_segment + (j << 5), s_offset, 0);
+    }
+#endif
+    return(done);
+}
+#else
+#define sd_cache_read(log_sector, count, s_segment, s_offset) \
+                        sd_read_sectors(log_sector, count, 0, s_segment, s_offset)  // no cache, straight to the card
+#define sd_cache_write  sd_write_sectors
+#endif
+
 //--------------------------------------------------------------------------
 void __cdecl int13_harddisk(rDS, rES, rDI, rSI, rBP, rBX, rDX, rCX, rAX, rIP, rCS, rFLAGS)
 Bit16u rDS, rES, rDI, rSI, rBP, rBX, rDX, rCX, rAX, rIP, rCS, rFLAGS;
@@ -710,10 +1698,10 @@ Bit16u rDS, rES, rDI, rSI, rBP, rBX, rDX, rCX, rAX, rIP, rCS, rFLAGS;
     Bit16u   hd_cylinders;
     Bit8u    hd_heads, hd_sectors;
     Bit8u    sector_count;
-    Bit16u   tempbx;
-    Bit16u   addr_l, addr_h;
     Bit32u   log_sector;
     Bit8u    tmp;
+    Bit16u   dap_count, dap_done, dap_offset, dap_seg;
+    Bit32u   total;
 
     SET_IF();   // Turn on IF when Flag Register is popped off the stack
 
@@ -737,11 +1725,21 @@ Bit16u rDS, rES, rDI, rSI, rBP, rBX, rDX, rCX, rAX, rIP, rCS, rFLAGS;
     switch(GET_AH()) {      // AH = Disk command
 
         case 0x00:                              // disk controller reset
-            SET_AH(0x00);                       // Success
-            SET_DISK_RET_STATUS(0);             // 
             set_diskette_ret_status(0);
             set_diskette_current_cyl(0, 0);     // current cylinder, diskette 1 
             set_diskette_current_cyl(1, 0);     // current cylinder, diskette 2 
+#if SD_CACHE
+            __asm { sti }                       // the flush waits on the tick counter
+            status = sd_cache_flush();          // write back dirty cached sectors
+            if(status) {
+                SET_AH(status);
+                SET_DISK_RET_STATUS(status);
+                SET_CF();                       // error occurred
+                break;
+            }
+#endif
+            SET_AH(0x00);                       // Success
+            SET_DISK_RET_STATUS(0);             // 
             CLEAR_CF();                         // successful 
             break;
 
@@ -756,9 +1754,9 @@ Bit16u rDS, rES, rDI, rSI, rBP, rBX, rDX, rCX, rAX, rIP, rCS, rFLAGS;
         case 0x04:                              // verify disk sectors
         case 0x02:                              // read disk sectors
             drive        = GET_DL();            // Get drive number
-            hd_cylinders = HD_CYLINDERS;        // get_hd_geometry(drive, &hd_cylinders, &hd_heads, &hd_sectors);
-            hd_heads     = HD_HEADS;            // fixed geometry:
-            hd_sectors   = HD_SECTORS;          // Hard drive sectors
+            hd_cylinders = read_word(EBDA_SEG, EBDA_SD_CYLINDERS);  // geometry from sd_card_post()
+            hd_heads     = read_byte(EBDA_SEG, EBDA_SD_HEADS);
+            hd_sectors   = read_byte(EBDA_SEG, EBDA_SD_SECTORS);
             num_sectors  =  GET_AL();           // Number of sectors requested
             cylinder     = (GET_CL() & 0x00c0) << 2 | GET_CH();
             sector       = (GET_CL() & 0x3f);
@@ -779,80 +1777,16 @@ Bit16u rDS, rES, rDI, rSI, rBP, rBX, rDX, rCX, rAX, rIP, rCS, rFLAGS;
             log_sector = ((Bit32u)cylinder) * ((Bit32u)hd_heads) * ((Bit32u)hd_sectors)
                          + ((Bit32u)head) * ((Bit32u)hd_sectors) + ((Bit32u)sector) - 1;
 
-            sector_count = 0;
-            tempbx = rBX;
-
             __asm { sti }  //;; enable higher priority interrupts
-            while(1) {
-                addr_l = ((Bit16u) log_sector) << 9;
-                addr_h =  (Bit16u) (log_sector >> 7);
-
-                __asm {
-                   mov   es, rES                // ES: destination segment
-                   mov   di, tempbx             // DI: destination offset from bx
-                   cmp   di, 0xfe00             // adjust if there will be an overrun
-                   jbe   i13_f02_no_adjust
-                   
-                i13_f02_adjust:
-                    sub   di, 0x0200            // sub 512 bytes from offset
-                    mov   ax, es
-                    add   ax, 0x0020            // add 512 to segment
-                    mov   es, ax
-
-                i13_f02_no_adjust:
-                    mov   bx, addr_l
-                    mov   cx, addr_h
-
-                    mov   dx, 0x0100        // SD card IO Port 
-                    mov   ax, 0x51          // CS = 0, command CMD17
-                    out   dx, ax
-                    mov   al, ch            // addr[31:24]
-                    out   dx, al
-                    mov   al, cl            // addr[23:16]
-                    out   dx, al
-                    mov   al, bh            // addr[15:8]
-                    out   dx, al
-                    mov   al, bl            // addr[7:0]
-                    out   dx, al
-                    mov   al, 0x0ff         // CRC (not used)
-                    out   dx, al
-                    out   dx, al            // wait
-
-                i13_f02_read_res_cmd17:
-                    in    al, dx            // card response
-                    cmp   al, 0
-                    jne   i13_f02_read_res_cmd17
-
-                i13_f02_read_tok_cmd17:     // read data token: 0xfe
-                    in    al, dx
-                    cmp   al, 0x0fe
-                    jne   i13_f02_read_tok_cmd17
-                    mov   cx, 0x100
-                    
-                i13_f02_read_bytes:
-                    in    al, dx                 // low byte
-                    mov   bl, al
-                    in    al, dx                 // high byte
-                    mov   bh, al
-                    mov   word ptr es:[di], bx   // eseg
-                    add   di, 2
-                    loop  i13_f02_read_bytes
-
-                    mov   ax, 0xffff    //; we are done, retrieve checksum
-                    out   dx, al        //; Checksum, 1st byte
-                    out   dx, al        //; Checksum, 2nd byte
-                    out   dx, al        //; wait
-                    out   dx, al        //; wait
-                    out   dx, ax        //; CS = 1 (disable SD)
-
-                i13_f02_done:           //;; store real DI register back to temp bx
-                    mov  tempbx, di
-                }
-                sector_count++;
-                log_sector++;
-                num_sectors--;
-                if(num_sectors) continue;
-                else            break;
+            sector_count = (Bit8u)sd_cache_read(log_sector, num_sectors, rES, rBX);
+            if(sector_count != num_sectors) {   // card failed or timed out
+                status = read_byte(EBDA_SEG, EBDA_SD_STATUS);
+                SET_AH(status);
+                SET_AL(sector_count);       // Sectors read before the fault, kept next to
+                                            // SET_AH as the BDA write goes through AX
+                SET_DISK_RET_STATUS(status);
+                SET_CF();                   // error occurred
+                break;
             }
             SET_AH(0x00);                   // Indicate success
             SET_DISK_RET_STATUS(0);         // Set status
@@ -861,10 +1795,10 @@ Bit16u rDS, rES, rDI, rSI, rBP, rBX, rDX, rCX, rAX, rIP, rCS, rFLAGS;
             break;
 
         case 0x03:                          // write disk sectors 
-            drive        = GET_DL();        // get_hd_geometry(drive, &hd_cylinders, &hd_heads, &hd_sectors);
-            hd_cylinders = HD_CYLINDERS;    // fixed geometry:
-            hd_heads     = HD_HEADS;
-            hd_sectors   = HD_SECTORS;
+            drive        = GET_DL();
+            hd_cylinders = read_word(EBDA_SEG, EBDA_SD_CYLINDERS);  // geometry from sd_card_post()
+            hd_heads     = read_byte(EBDA_SEG, EBDA_SD_HEADS);
+            hd_sectors   = read_byte(EBDA_SEG, EBDA_SD_SECTORS);
 
             num_sectors = GET_AL();
             cylinder    = GET_CH();
@@ -881,104 +1815,29 @@ Bit16u rDS, rES, rDI, rSI, rBP, rBX, rDX, rCX, rAX, rIP, rCS, rFLAGS;
             log_sector = ((Bit32u)cylinder) * ((Bit32u)hd_heads) * ((Bit32u)hd_sectors)
                         + ((Bit32u)head) * ((Bit32u)hd_sectors) + ((Bit32u)sector) - 1;
 
-            sector_count = 0;
-            tempbx = rBX;
-
             __asm { sti }  //;; enable higher priority interrupts
-            while(1) {
-                addr_l = ((Bit16u) log_sector)<< 9;
-                addr_h =  (Bit16u)(log_sector >> 7);
-
-                __asm {
-                        mov   es, rES           //;; ES: source segment
-                        mov   si, tempbx        //;; SI: source offset from temp bx 
-                        cmp   si, 0xfe00        //;; adjust if there will be an overrun
-                        jbe   i13_f03_no_adjust
-                        
-                i13_f03_adjust:
-                        sub   si, 0x0200    //; sub 512 bytes from offset
-                        mov   ax, es
-                        add   ax, 0x0020    //; add 512 to segment
-                        mov   es, ax
-
-                i13_f03_no_adjust:
-                        mov   bx, addr_l
-                        mov   cx, addr_h
-
-                        mov   dx, 0x0100    //; SD card Port
-                        mov   ax, 0x58      //; CS = 0, SD card command CMD24
-                        out   dx, ax
-                        mov   al, ch        //; addr[31:24]
-                        out   dx, al
-                        mov   al, cl        //; addr[23:16]
-                        out   dx, al
-                        mov   al, bh        //; addr[15:8]
-                        out   dx, al
-                        mov   al, bl        //; addr[7:0]
-                        out   dx, al
-                        mov   al, 0xff      //; CRC (not used)
-                        out   dx, al
-                        out   dx, al        //; wait
-
-                i13_f03_read_res_cmd24:
-                        in    al, dx        //; command response
-                        cmp   al, 0
-                        jne   i13_f03_read_res_cmd24
-                        mov   al, 0xff      //; wait
-                        out   dx, al
-                        mov   al, 0xfe      //; start of block: token 0xfe
-                        out   dx, al
-                        mov   cx, 0x100
-                        
-                i13_f03_write_bytes:
-                        mov   ax, word ptr es:[si]      // eseg
-                        out   dx, al
-                        mov   al, ah
-                        out   dx, al
-                        add   si, 2
-                        loop  i13_f03_write_bytes
-                        
-                        mov   al, 0xff          //; send dummy checksum
-                        out   dx, al
-                        out   dx, al
-                        
-                        in    al, dx            //; data response
-                        and   al, 0x0f
-                        cmp   al, 0x05
-                        je    i13_f03_good_write
-                        hlt                     //; problem writing
-
-                i13_f03_good_write:             //; write finished?
-                        in    al, dx
-                        cmp   al, 0
-                        je    i13_f03_good_write
-
-                        mov   ax,  0xffff       //; goodbye mr. writer!
-                        out   dx, al            //; wait
-                        out   dx, al            //; wait
-                        out   dx, ax            //; CS = 1 (disable SD)
-
-                i13_f03_done:   //;; store real SI register back to temp bx
-                        mov  tempbx, si
-                }
-
-            sector_count++;
-            log_sector++;
-            num_sectors--;
-            if(num_sectors) continue;
-            else            break;
-        }
-        SET_AH(0x00);               // Return success
-        SET_DISK_RET_STATUS(0);     // Set Status 
-        SET_AL(sector_count);       // Return sectors done
-        CLEAR_CF();                 // successful
-        break;
+            status = 0;
+            sector_count = (Bit8u)sd_cache_write(log_sector, num_sectors, rES, rBX);
+            if(sector_count != num_sectors) status = read_byte(EBDA_SEG, EBDA_SD_STATUS);
+            if(status) {                    // card rejected a block or timed out
+                SET_AH(status);
+                SET_AL(sector_count);       // Sectors written before the fault, kept next to
+                                            // SET_AH as the BDA write goes through AX
+                SET_DISK_RET_STATUS(status);
+                SET_CF();                   // error occurred
+                break;
+            }
+            SET_AH(0x00);                   // Return success
+            SET_DISK_RET_STATUS(0);         // Set Status 
+            SET_AL(sector_count);           // Return sectors done
+            CLEAR_CF();                     // successful
+            break;
 
         case 0x08:                        // Get Current Drive Parameters 
-            drive        = GET_DL();      // same as get_hd_geometry(drive, &hd_cylinders, &hd_heads, &hd_sectors);
-            hd_cylinders = HD_CYLINDERS;  // fixed geometry:
-            hd_heads     = HD_HEADS;
-            hd_sectors   = HD_SECTORS;
+            drive        = GET_DL();
+            hd_cylinders = read_word(EBDA_SEG, EBDA_SD_CYLINDERS);  // geometry from sd_card_post()
+            hd_heads     = read_byte(EBDA_SEG, EBDA_SD_HEADS);
+            hd_sectors   = read_byte(EBDA_SEG, EBDA_SD_SECTORS);
             max_cylinder = hd_cylinders - 2; // 0 based 
             SET_AL(0x00);
             tmp = (Bit8u)(max_cylinder & 0xff);
@@ -1011,10 +1870,10 @@ Bit16u rDS, rES, rDI, rSI, rBP, rBX, rDX, rCX, rAX, rIP, rCS, rFLAGS;
             break;
 
         case 0x15:                         // read disk drive size 
-            drive        = GET_DL();       // same as get_hd_geometry(drive, &hd_cylinders, &hd_heads, &hd_sectors);
-            hd_cylinders = HD_CYLINDERS;   // fixed geometry:
-            hd_heads     = HD_HEADS;
-            hd_sectors   = HD_SECTORS;
+            drive        = GET_DL();
+            hd_cylinders = read_word(EBDA_SEG, EBDA_SD_CYLINDERS);  // geometry from sd_card_post()
+            hd_heads     = read_byte(EBDA_SEG, EBDA_SD_HEADS);
+            hd_sectors   = read_byte(EBDA_SEG, EBDA_SD_SECTORS);
             
             __asm {
                     mov  al, hd_heads           //;; al = heads
@@ -1032,6 +1891,128 @@ Bit16u rDS, rES, rDI, rSI, rBP, rBX, rDX, rCX, rAX, rIP, rCS, rFLAGS;
             CLEAR_CF();             // successful
             break;
 
+        //------------------------------------------------------------------
+        // INT13 Extensions (EDD 3.0): the disk address packet at DS:SI is
+        //   00 u8  packet size (0x10)     04 u16 buffer offset
+        //   01 u8  reserved               06 u16 buffer segment
+        //   02 u16 sector count           08 u64 starting LBA
+        //------------------------------------------------------------------
+        case 0x41:                          // installation check
+            if(rBX != 0x55aa) {
+                SET_AH(0x01);
+                SET_DISK_RET_STATUS(1);
+                SET_CF();
+                break;
+            }
+            SET_BX(0xaa55);                 // extensions installed
+            SET_AH(0x30);                   // EDD 3.0
+            SET_CX(0x0001);                 // fixed disk access subset (42h-44h, 47h, 48h)
+            CLEAR_CF();
+            break;
+
+        case 0x42:                          // extended read
+        case 0x43:                          // extended write
+        case 0x44:                          // extended verify
+        case 0x47:                          // extended seek
+            dap_count  = read_word(rDS, rSI + 2);
+            dap_offset = read_word(rDS, rSI + 4);
+            dap_seg    = read_word(rDS, rSI + 6);
+            log_sector = ((Bit32u)read_word(rDS, rSI + 10) << 16) | read_word(rDS, rSI + 8);
+            total      = edd_total_sectors();
+
+            if(read_byte(rDS, rSI) < 0x10 || read_word(rDS, rSI + 12) || read_word(rDS, rSI + 14)
+               || (dap_seg == 0xffff && dap_offset == 0xffff)       // 64-bit flat buffer, not on 8086
+               || log_sector >= total || dap_count > total - log_sector) {
+                write_word(rDS, rSI + 2, 0);    // nothing transferred
+                SET_AH(0x01);
+                SET_DISK_RET_STATUS(1);
+                SET_CF();                       // error occurred
+                break;
+            }
+
+            status = 0;
+            __asm { sti }  //;; enable higher priority interrupts
+            if(GET_AH() == 0x42) {
+                dap_done = sd_cache_read(log_sector, dap_count, dap_seg, dap_offset);
+            }
+            else if(GET_AH() == 0x43) {
+                dap_done = sd_cache_write(log_sector, dap_count, dap_seg, dap_offset);
+            }
+            else dap_done = dap_count;
+            if(dap_done != dap_count) status = read_byte(EBDA_SEG, EBDA_SD_STATUS);
+
+            write_word(rDS, rSI + 2, dap_done);  // blocks actually transferred
+            SET_AH(status);
+            SET_DISK_RET_STATUS(status);
+            if(status) { SET_CF();   }
+            else       { CLEAR_CF(); }
+            break;
+
+        case 0x48:                          // get drive parameters
+            dap_count = read_word(rDS, rSI);    // caller's buffer size
+            if(dap_count < 0x1a) {
+                SET_AH(0x01);
+                SET_DISK_RET_STATUS(1);
+                SET_CF();
+                break;
+            }
+            hd_cylinders = read_word(EBDA_SEG, EBDA_SD_CYLINDERS);
+            hd_heads     = read_byte(EBDA_SEG, EBDA_SD_HEADS);
+            hd_sectors   = read_byte(EBDA_SEG, EBDA_SD_SECTORS);
+            total        = edd_total_sectors();
+
+            write_word(rDS, rSI + 0x02, 0x0002);        // flags: CHS information is valid
+            write_word(rDS, rSI + 0x04, hd_cylinders);  // u32 cylinders
+            write_word(rDS, rSI + 0x06, 0);
+            write_word(rDS, rSI + 0x08, hd_heads);      // u32 heads
+            write_word(rDS, rSI + 0x0a, 0);
+            write_word(rDS, rSI + 0x0c, hd_sectors);    // u32 sectors per track
+            write_word(rDS, rSI + 0x0e, 0);
+            write_word(rDS, rSI + 0x10, (Bit16u)total); // u64 total sectors
+            write_word(rDS, rSI + 0x12, (Bit16u)(total >> 16));
+            write_word(rDS, rSI + 0x14, 0);
+            write_word(rDS, rSI + 0x16, 0);
+            write_word(rDS, rSI + 0x18, SECTOR_SIZE);   // bytes per sector
+            if(dap_count >= 0x1e) {                     // EDD 2.0+: no DPTE
+                write_word(rDS, rSI + 0x1a, 0xffff);
+                write_word(rDS, rSI + 0x1c, 0xffff);
+                write_word(rDS, rSI, 0x1e);
+            }
+            else write_word(rDS, rSI, 0x1a);
+
+            SET_AH(0x00);
+            SET_DISK_RET_STATUS(0);
+            CLEAR_CF();
+            break;
+
+#if SD_CACHE
+        //------------------------------------------------------------------
+        // ZBC SD cache control, AL = subfunction:
+        //   00 copy the statistics to ES:DI:
+        //      00 u32 hits    04 u32 misses    08 u16 sets
+        //      0A u8  ways    0B u8  1 = write-back, 0 = write-through
+        //   01 clear the hit and miss counters
+        //   02 write back all dirty sectors
+        //------------------------------------------------------------------
+        case 0xf0:
+            __asm { sti }
+            status = 0;
+            if(GET_AL() == 0x00) {
+                memcpyb(rES, rDI, EBDA_SEG, EBDA_SD_CACHE_HITS, 8);
+                write_word(rES, rDI + 0x08, SD_CACHE_SETS);
+                write_byte(rES, rDI + 0x0a, SD_CACHE_WAYS);
+                write_byte(rES, rDI + 0x0b, SD_CACHE_WRITE_BACK);
+            }
+            else if(GET_AL() == 0x01) memsetb(EBDA_SEG, EBDA_SD_CACHE_HITS, 0, 8);
+            else if(GET_AL() == 0x02) status = sd_cache_flush();
+            else                      status = 0x01;    // invalid subfunction
+            SET_AH(status);
+            SET_DISK_RET_STATUS(status);
+            if(status) { SET_CF();   }
+            else       { CLEAR_CF(); }
+            break;
+#endif
+
         default:
             BX_INFO("int13_harddisk: function %02xh unsupported, returns fail\n", GET_AH());
             SET_AH(0x01); // defaults to invalid function in AH or invalid parameter
@@ -1048,48 +2029,39 @@ Bit16u rDS, rES, rDI, rSI, rBP, rBX, rDX, rCX, rAX, rIP, rCS, rFLAGS;
 //--------------------------------------------------------------------------
 #define FLASH_FLOPPY   0x020000         // Starting address of floppy on flash
 //--------------------------------------------------------------------------
-static void transf_sect_drive_a(Bit16u Sector, Bit16u s_segment, Bit16u s_offset)
+// The floppy image is laid out linearly from FLASH_FLOPPY, so a request of
+// count sectors is one read command and a single stream of count * 512
+// bytes. The destination is normalized once and the segment is stepped by
+// 512 bytes after every sector so the buffer may cross 64K boundaries.
+//--------------------------------------------------------------------------
+static void transf_sect_drive_a(Bit16u Sector, Bit16u count, Bit16u s_segment, Bit16u s_offset)
 {
     Bit32u Flash_Addr;
-    Bit8u  USB, MSB, LSB;
+    Bit8u  USB, MSB;
 
+    if(count == 0) return;
     Flash_Addr = (Bit32u)Sector;
     Flash_Addr = (Flash_Addr * 512 + FLASH_FLOPPY) & 0x00FFFFFF; // can not be more than 24 bits
     USB = (Flash_Addr >> 16) & 0xFF;  // Upper most siginificant byte of the address
     MSB = (Flash_Addr >>  8) & 0xFF;  // Middle most siginificant byte of the address
-//    LSB = (Flash_Addr      ) & 0xFF;  // Lower most siginificant byte of the address
-    
-/*
-    // trickey math to compute bytes of address
-    // example sector # 2048 = 0x800 *512 = 0x10_00_00 
-    // example sector # 2048 = 0x800, USB = Sector / <<1  = 0x10_00    so LSB is always 00 
-    // note, to get USB, you can do a >>7 which is 8-1, or /128 (remember LSR is same /2)
+                                      // LSB is always zero, sectors are 512 byte aligned
+    s_segment += s_offset >> 4;       // normalize, the offset is now 0..15
+    s_offset  &= 0x000f;
 
-    Bit8u  USB, MSB;
-    Sector += 0x100;                    // this could easily be moved into assembly 
-    USB = (Sector / 128) & 0xFF;        // Compute the upper most significan byte of the address
-    MSB = (Sector *   2) & 0xFF;        // Compute the middle byte of the address
-*/                            
     __asm {
                 push  ax                // Save all the registers we are
                 push  bx                // about to use onto the stack
                 push  cx
                 push  dx
                 push  di
-                push  ds
+                push  es
 
                 mov  ax, s_segment       // Load the segment address
-                mov  ds, ax              // intot the data segment register
-                mov  bx, s_offset        // load the offset
-                cmp  bx, 0xfe00          // adjust if there will be an overrun
-                jbe  transf_dat          // If no adjustment needed, do the transfer
-                        
-                sub   bx, 0x0200         // sub 512 bytes from offset
-                mov   ax, ds             // get the old segment
-                add   ax, 0x0020         // add 512 to segment
-                mov   ds, ax             // make this our new segment
-
-    transf_dat: mov  dx, SPIFLASH_PORT   // Load the address of the flash IO
+                mov  es, ax              // into the extra segment register
+                mov  di, s_offset        // and the offset into DI
+                mov  bx, count           // sectors to go
+
+                mov  dx, SPIFLASH_PORT   // Load the address of the flash IO
                 mov  ax, 0xFE03          // Starting Read Commad and lower /CS
                 out  dx, ax              // brings /CS low and loads MSB address byte
 
@@ -1099,16 +2071,22 @@ static void transf_sect_drive_a(Bit16u Sector, Bit16u s_segment, Bit16u s_offset
                 out  dx, al              // and loads 2nd address byte
                 xor  al, al              // LSB address byte is always zero
                 out  dx, al              // and loads 3rd address byte
+                cld
 
-                mov  cx, 512             // 512 bytes in 1 sector
-                xor  di, di
+    next_sect:  mov  cx, 512             // 512 bytes in 1 sector
     one_sect:   in   al, dx              // read byte from flash
-                mov  ds:[bx+di], al      // write byte
-                inc  di                  // Increment to next RAM address
+                stosb                    // write byte, next RAM address
                 loop one_sect            // Loop 512 times
+                sub  di, 512             // step ES by the sector instead of DI
+                mov  ax, es              // so DI can never wrap
+                add  ax, 0x0020
+                mov  es, ax
+                dec  bx                  // the flash keeps streaming the
+                jnz  next_sect           // following sectors
+
                 mov  ax, 0xFFFF          // NOP plus make /CS high
-                out  dx, ax              // brings /CS low and loads MSB address byte
-                pop  ds                  
+                out  dx, ax              // brings /CS high, ends the read
+                pop  es                  
                 pop  di
                 pop  dx
                 pop  cx
@@ -1117,6 +2095,139 @@ static void transf_sect_drive_a(Bit16u Sector, Bit16u s_segment, Bit16u s_offset
     }
 }
 
+#if RAMDISK_WRITE_BACK && RAMDISK_FROM_FLASH
+//--------------------------------------------------------------------------
+// SPI flash writes, used to save the RAM disk back to the floppy image.
+// Each command is one /CS low period: the high byte of a word write sets
+// /CS, the low byte is shifted out. The flash is an SST25, so a block is
+// erased with 0xD8 (64K) or 0x20 (4K) and programmed with AAI word writes.
+//--------------------------------------------------------------------------
+static void flash_command(Bit8u cmd)
+{
+    outw(SPIFLASH_PORT, 0xFE00 | cmd);          // /CS low, opcode
+    outw(SPIFLASH_PORT, 0xFFFF);                // /CS high
+}
+//--------------------------------------------------------------------------
+static Bit8u flash_read_status(void)
+{
+    Bit8u status;
+
+    outw(SPIFLASH_PORT, 0xFE00 | FLASH_RDSR);
+    status = inb(SPIFLASH_PORT);
+    outw(SPIFLASH_PORT, 0xFFFF);
+    return(status);
+}
+//--------------------------------------------------------------------------
+static void flash_write_status(Bit8u value)
+{
+    flash_command(FLASH_EWSR);                  // must come right before WRSR
+    outw(SPIFLASH_PORT, 0xFE00 | FLASH_WRSR);
+    outb(SPIFLASH_PORT, value);
+    outw(SPIFLASH_PORT, 0xFFFF);
+}
+//--------------------------------------------------------------------------
+static Bit8u flash_wait_ready(void)
+{
+    Bit16u start;
+
+    start = read_word(0x0040, 0x006c);
+    while(flash_read_status() & 0x01) {         // BUSY
+        if(read_word(0x0040, 0x006c) - start > FLASH_TIMEOUT_TICKS) return(0x80);  // time out
+    }
+    return(0);
+}
+//--------------------------------------------------------------------------
+static Bit8u flash_erase(Bit32u Flash_Addr, Bit8u cmd)
+{
+    flash_command(FLASH_WREN);
+    outw(SPIFLASH_PORT, 0xFE00 | cmd);
+    outb(SPIFLASH_PORT, (Bit8u)(Flash_Addr >> 16));
+    outb(SPIFLASH_PORT, (Bit8u)(Flash_Addr >>  8));
+    outb(SPIFLASH_PORT, (Bit8u)Flash_Addr);
+    outw(SPIFLASH_PORT, 0xFFFF);                // erase starts when /CS goes high
+    return(flash_wait_ready());
+}
+//--------------------------------------------------------------------------
+// Program words from s_segment:s_offset into erased flash at Flash_Addr,
+// which is sector aligned. The first AAI command carries the address, the
+// following ones only their two data bytes. The busy poll after each word
+// is bounded by a loop count, it takes about 10us.
+//--------------------------------------------------------------------------
+static Bit8u flash_program(Bit32u Flash_Addr, Bit16u s_segment, Bit16u s_offset, Bit16u words)
+{
+    Bit8u  USB, MSB;
+    Bit16u left;
+
+    if(words == 0) return(0);
+    USB = (Flash_Addr >> 16) & 0xFF;
+    MSB = (Flash_Addr >>  8) & 0xFF;
+    flash_command(FLASH_WREN);
+
+    __asm {
+                push ax
+                push bx
+                push cx
+                push dx
+                push si
+                push ds
+
+                mov  bx, words           // words to go
+                mov  si, s_offset
+                mov  ax, s_segment
+                mov  ds, ax
+                mov  dx, SPIFLASH_PORT
+                cld
+
+                mov  ax, 0xFE00 + FLASH_AAI_WORD
+                out  dx, ax              // /CS low, AAI with the address
+                mov  al, USB
+                out  dx, al
+                mov  al, MSB
+                out  dx, al
+                xor  al, al              // sector aligned
+                out  dx, al
+                jmp  aai_data
+
+    aai_next:   mov  ax, 0xFE00 + FLASH_AAI_WORD
+                out  dx, ax              // /CS low, AAI without the address
+    aai_data:   lodsw
+                out  dx, al              // two data bytes
+                mov  al, ah
+                out  dx, al
+                mov  ax, 0xFFFF          // /CS high starts the write
+                out  dx, ax
+
+                xor  cx, cx              // poll limit
+    aai_busy:   mov  ax, 0xFE00 + FLASH_RDSR
+                out  dx, ax
+                in   al, dx
+                test al, 0x01            // BUSY, flags survive mov and out
+                mov  ax, 0xFFFF
+                out  dx, ax
+                jz   aai_done
+                loop aai_busy
+                jmp  aai_end             // timed out, BX words left
+
+    aai_done:   dec  bx
+                jnz  aai_next
+
+    aai_end:    mov  ax, 0xFE00 + FLASH_WRDI
+                out  dx, ax              // WRDI ends AAI mode
+                mov  ax, 0xFFFF
+                out  dx, ax
+                pop  ds
+                mov  left, bx
+                pop  si
+                pop  dx
+                pop  cx
+                pop  bx
+                pop  ax
+    }
+    if(left) return(0x80);
+    return(flash_wait_ready());
+}
+#endif
+
 //--------------------------------------------------------------------------
 //--------------------------------------------------------------------------
 // INT13 Diskette service function
@@ -1128,7 +2239,10 @@ Bit16u rDS, rES, rDI, rSI, rBP, rBX, rDX, rCX, rAX, rIP, rCS, rFLAGS;
     Bit8u  drive, num_sectors, track, sector, head;
     Bit8u  drive_type, num_floppies;
     Bit16u last_addr, base_address, base_count;
-    Bit16u log_sector, j, RamAddress;
+    Bit16u log_sector;
+#if RAMDISK_WRITE_BACK && RAMDISK_FROM_FLASH
+    Bit16u val16;
+#endif
 
     SET_IF();   // Turn on IF when Flag Register is popped off the stack
     switch(GET_AH()) {
@@ -1170,29 +2284,31 @@ Bit16u rDS, rES, rDI, rSI, rBP, rBX, rDX, rCX, rAX, rIP, rCS, rFLAGS;
             // 512 bytes per sector
             // 
             log_sector  = track * 36 + head * 18 + sector - 1;  // Calculate the first sector we are going to read
-            if(drive == DRIVE_A) {      // This is the Flash Based Drive
-                for(j = 0; j < num_sectors; j++) {
-                    transf_sect_drive_a((log_sector + j), rES, (rBX + (j << 9)));  // now just pass the place to copy it too, j<<9 is the same thing as multiplying by 512
-                }                 // a good optimizing compiler probably does this for you anyway, so you could just put j*512 and get the same result
+            if(drive == DRIVE_A && !(RAMDISK_DRIVE_A && RAMDISK_FROM_FLASH)) {      // This is the Flash Based Drive
+                transf_sect_drive_a(log_sector, num_sectors, rES, rBX);   // one flash read for all the sectors
             }
-            else {                  // This is the SDRAM based drive
-                base_address = (rES << 4) + rBX;           // Base Address is upper 12 bits of segment + offset
-                base_count   = (num_sectors * 512);        // Number of bytes to be transfered 
-                last_addr = base_address + base_count -1;  // Compute the last address is in the same segment
-                if(last_addr < base_address) {             // If the last address is less than the base then there must have been an overflow above !
-                    BX_INFO("int13_diskette - 03: 64K boundary overrun\n");
-                    SET_AH(0x09);
-                    set_diskette_ret_status(0x09);
-                    SET_AL(0x00);                                    // No sectors have been read
-                    SET_CF();                                        // An error occurred
-                    return;
+            else {                  // This is the SDRAM based drive, or drive A: served from its RAM copy
+                if(drive == DRIVE_B) {
+                    base_address = (rES << 4) + rBX;           // Base Address is upper 12 bits of segment + offset
+                    base_count   = (num_sectors * 512);        // Number of bytes to be transfered 
+                    last_addr = base_address + base_count -1;  // Compute the last address is in the same segment
+                    if(last_addr < base_address) {             // If the last address is less than the base then there must have been an overflow above !
+                        BX_INFO("int13_diskette - 03: 64K boundary overrun\n");
+                        SET_AH(0x09);
+                        set_diskette_ret_status(0x09);
+                        SET_AL(0x00);                                    // No sectors have been read
+                        SET_CF();                                        // An error occurred
+                        return;
+                    }
                 }
-                for(j = 0; j < num_sectors; j++) {
-                    BX_INFO("int13_diskette - 02: Accessing ramdisk\n");
-                    RamAddress = GetRamdiskSector(log_sector + j);  // Pass in the sector which will set the right RAM page and give back the ram address
-                    base_count = base_address + (j << 9);
-                    memcpyb(last_addr, base_count, EMS_SECTOR_OFFSET, RamAddress, SECTOR_SIZE);  // Copy the sector
+                if(log_sector + num_sectors > SECTOR_COUNT) {  // Past the end of the disk
+                    set_diskette_ret_status(0x04);
+                    SET_AH(0x04);                               // Sector not found
+                    SET_AL(0x00);
+                    SET_CF();
+                    return;
                 }
+                ramdisk_copy(log_sector, num_sectors, rES + (rBX >> 4), rBX & 0x000f, 0);  // 32K per copy
             }
             set_diskette_current_cyl(drive, track); // ??? should track be new val from return_status[3] ?
             SET_AH(0);      // AH = 0, sucess AL = number of sectors read (same value as passed)
@@ -1295,6 +2411,31 @@ Bit16u rDS, rES, rDI, rSI, rBP, rBX, rDX, rCX, rAX, rIP, rCS, rFLAGS;
             CLEAR_CF();                     // successful
             break;
 
+#if RAMDISK_WRITE_BACK && RAMDISK_FROM_FLASH
+        //------------------------------------------------------------------
+        // ZBC RAM disk write back, AL = subfunction:
+        //   00 save the 64K flash blocks holding dirty sectors,
+        //      AL = blocks written
+        //   01 CX = number of dirty sectors
+        //------------------------------------------------------------------
+        case 0xf0:
+            __asm { sti }
+            if(GET_AL() == 0x00) {
+                val16 = ramdisk_flush();
+                SET_AX(val16);              // AH = status, AL = blocks
+            }
+            else if(GET_AL() == 0x01) {
+                val16 = ramdisk_dirty_count();
+                SET_CX(val16);
+                SET_AH(0x00);
+            }
+            else SET_AH(0x01);              // invalid subfunction
+            set_diskette_ret_status(GET_AH());
+            if(GET_AH()) { SET_CF();   }
+            else         { CLEAR_CF(); }
+            break;
+#endif
+
         case 0x03:                      // Write disk sector
             num_sectors = GET_AL();     // number of sectors to write (1-128 dec.)
             track       = GET_CH();     // track/cylinder number (0-1023 dec.)
@@ -1323,13 +2464,19 @@ Bit16u rDS, rES, rDI, rSI, rBP, rBX, rDX, rCX, rAX, rIP, rCS, rFLAGS;
                     return;
                 }
                 log_sector    = track * 36 + head * 18 + sector - 1;    // Calculate the first sector we are going to read
+                if(log_sector + num_sectors > SECTOR_COUNT) {  // Past the end of the disk
+                    set_diskette_ret_status(0x04);
+                    SET_AH(0x04);                               // Sector not found
+                    SET_AL(0x00);
+                    SET_CF();
+                    return;
+                }
 
                 // This is the SDRAM based drive
-                for(j = 0; j < num_sectors; j++) {
-                    RamAddress = GetRamdiskSector(log_sector + j);   // Pass in the sector which will set the right RAM page and give back the ram address
-                    base_count = base_address + (j << 9);
-                    memcpyb(EMS_SECTOR_OFFSET, RamAddress, rES, base_count, SECTOR_SIZE);        // Copy the sector
-                }
+                ramdisk_copy(log_sector, num_sectors, rES + (rBX >> 4), rBX & 0x000f, 1);  // 32K per copy
+#if RAMDISK_WRITE_BACK && RAMDISK_FROM_FLASH
+                ramdisk_mark_dirty(log_sector, num_sectors);   // to be saved to flash on AH=F0h
+#endif
                 set_diskette_current_cyl(drive, track);   // ??? should track be new val from return_status[3] ?
                 SET_AH(0x00); // success  - AL = number of sectors read (same value as passed)
                 CLEAR_CF();   // success
@@ -1359,34 +2506,156 @@ static void set_diskette_current_cyl(Bit8u drive, Bit8u cyl)
 //--------------------------------------------------------------------------
 //--------------------------------------------------------------------------
 // The principle of this routine is to copy directly from flash to the ram disk
-// To work we will need a verion of the transfer function made
+// The RAM disk is mapped into EMS windows 1 and 2, 32K at a time, and each
+// pair is filled with one streaming flash read of its 64 sectors.
+// The copy is timed with the tick counter, so interrupts are on while it runs.
 //--------------------------------------------------------------------------
 //--------------------------------------------------------------------------
 void MakeRamdisk(void)
 {
-/*    
-    Bit16u Sector, base_count;
+#if RAMDISK_FROM_FLASH
+    Bit16u Sector, count, start;
+    Bit32u ms;
+
     outb(EMS_ENABLE_REG, EMS_ENABLE_VAL);               // Turn on EMS from 0xB0000 - 0xBFFFF
-    for(Sector = 0; Sector < SECTOR_COUNT; Sector++) {  // Configure the sector address
-        base_count = GetRamdiskSector(Sector);  // Select the Flash Page and get the address within the page of the Sector
-        transf_sect_drive_ram(Sector, EMS_SECTOR_OFFSET, base_count);     // We now have the correct page of selected and the sector is always in the same place so just pass the place to copy it too
+    __asm { pushf }
+    __asm { sti }
+    start = read_word(0x0040, 0x006c);
+    for(Sector = 0; Sector < SECTOR_COUNT; Sector += count) {   // One 32K window at a time
+        count = SECTOR_COUNT - Sector;
+        if(count > RAMDISK_WINDOW_SECTORS) count = RAMDISK_WINDOW_SECTORS;
+        GetRamdiskSectors(Sector, count);                   // Select the pages, the sector is at the start
+        transf_sect_drive_a(Sector, count, EMS_SECTOR_OFFSET, 0);
     }
-*/
+#if RAMDISK_WRITE_BACK && RAMDISK_FROM_FLASH
+    outb(EMS_PAGE2_REG, RAMDISK_DIRTY_PAGE);
+    memsetb(EMS_SECTOR_OFFSET, RAMDISK_DIRTY_OFFSET, 0, SECTOR_COUNT / 8);  // RAM disk matches the flash
+#endif
+    ms = (Bit32u)(read_word(0x0040, 0x006c) - start) * 55;     // 18.2 ticks per second
+    __asm { popf }
+    printf("RAM disk: %u sectors copied from flash in %lu ms\n", SECTOR_COUNT, ms);
+#endif
+    boot_profile_stamp(BOOT_MARK_RAMDISK);
 }
 
 //--------------------------------------------------------------------------
 // The RAM Disk is stored at 0x110000 to 0x277FFF in the SDRAM
 // The bits above the upper five bits tells us which memory location
 // The lower five bits tells us where in the 16K Page the Sector is
+// The pages holding Count sectors from Sector are mapped into EMS windows
+// 1 and 2 (32K), so the request fits if (Sector & 31) + Count <= 64.
+// Windows 3 and 4 are never used: B8000-BFFFF decodes to VGA text memory.
+// The SD cache remaps window 2 on every use.
 //--------------------------------------------------------------------------
-static Bit16u GetRamdiskSector(Bit16u Sector)
+static Bit16u GetRamdiskSectors(Bit16u Sector, Bit16u Count)
 {
-    Bit16u Page;
+    Bit16u Page, Last;
     Page = RAM_DISK_BASE + (Sector >> 5);
-    outb(EMS_PAGE1_REG, Page);       // Set the first 16K
+    Last = RAM_DISK_BASE + ((Sector + Count - 1) >> 5);
+    outb(EMS_PAGE1_REG, Page);                              // Set the first 16K
+    if(Last > Page) outb(EMS_PAGE2_REG, Page + 1);          // and the next one if the request runs into it
     return((Sector & 0x001F) << 9); // Return the memory location within the sector
 }
 
+//--------------------------------------------------------------------------
+// Copy Count RAM disk sectors from Sector to (write = 0) or from (write = 1)
+// s_segment:s_offset, as many copies as it takes to keep every one inside
+// the two windows GetRamdiskSectors() maps.
+//--------------------------------------------------------------------------
+static void ramdisk_copy(Bit16u Sector, Bit16u Count, Bit16u s_segment, Bit16u s_offset, BOOL write)
+{
+    Bit16u n, RamAddress;
+
+    while(Count) {
+        n = RAMDISK_WINDOW_SECTORS - (Sector & 0x001F);
+        if(n > Count) n = Count;
+        RamAddress = GetRamdiskSectors(Sector, n);
+        if(write) memcpyb(EMS_SECTOR_OFFSET, RamAddress, s_segment, s_offset, n << 9);
+        else      memcpyb(s_segment, s_offset, EMS_SECTOR_OFFSET, RamAddress, n << 9);
+        s_segment += n << 5;
+        Sector    += n;
+        Count     -= n;
+    }
+}
+
+#if RAMDISK_WRITE_BACK && RAMDISK_FROM_FLASH
+//--------------------------------------------------------------------------
+// Dirty map: one bit per RAM disk sector, set by drive B: writes and
+// cleared when the sector's flash block has been rewritten.
+//--------------------------------------------------------------------------
+static void ramdisk_mark_dirty(Bit16u Sector, Bit16u Count)
+{
+    Bit16u addr;
+
+    outb(EMS_PAGE2_REG, RAMDISK_DIRTY_PAGE);
+    for(; Count; Count--, Sector++) {
+        addr = RAMDISK_DIRTY_OFFSET + (Sector >> 3);
+        write_byte(EMS_SECTOR_OFFSET, addr, read_byte(EMS_SECTOR_OFFSET, addr) | (1 << (Sector & 7)));
+    }
+}
+//--------------------------------------------------------------------------
+static Bit16u ramdisk_dirty_count(void)
+{
+    Bit16u i, count;
+    Bit8u  bits;
+
+    outb(EMS_PAGE2_REG, RAMDISK_DIRTY_PAGE);
+    count = 0;
+    for(i = 0; i < SECTOR_COUNT / 8; i++) {
+        for(bits = read_byte(EMS_SECTOR_OFFSET, RAMDISK_DIRTY_OFFSET + i); bits; bits &= bits - 1) count++;
+    }
+    return(count);
+}
+//--------------------------------------------------------------------------
+// Save the RAM disk to the flash floppy image. Only the 64K erase blocks
+// holding a dirty sector are erased and reprogrammed, straight from the
+// RAM disk in two 32K halves mapped through EMS windows 1 and 2, the
+// dirty map is mapped through window 2 in between. The image ends half way
+// into its last block, so that one is erased 4K at a time to leave the
+// flash beyond the image alone. The block protection is lifted for the
+// writes and put back afterwards. Returns AH = status, AL = blocks written.
+//--------------------------------------------------------------------------
+static Bit16u ramdisk_flush(void)
+{
+    Bit16u Sector, count, i, n, blocks;
+    Bit32u Flash_Addr;
+    Bit8u  protect, status, dirty;
+
+    protect = flash_read_status() & 0xBC;       // BPL and BP3..BP0
+    flash_write_status(0);                      // unprotect
+    blocks = 0;
+    status = 0;
+    for(Sector = 0; Sector < SECTOR_COUNT; Sector += count) {
+        count = SECTOR_COUNT - Sector;
+        if(count > FLASH_BLOCK_SECTORS) count = FLASH_BLOCK_SECTORS;
+
+        outb(EMS_PAGE2_REG, RAMDISK_DIRTY_PAGE);
+        dirty = 0;
+        for(i = 0; i < count / 8; i++) dirty |= read_byte(EMS_SECTOR_OFFSET, RAMDISK_DIRTY_OFFSET + Sector / 8 + i);
+        if(!dirty) continue;                    // flash block is up to date
+
+        Flash_Addr = FLASH_FLOPPY + ((Bit32u)Sector << 9);
+        if(count == FLASH_BLOCK_SECTORS) status = flash_erase(Flash_Addr, FLASH_ERASE_64K);
+        else for(i = 0; i < count && !status; i += 8) status = flash_erase(Flash_Addr + ((Bit32u)i << 9), FLASH_ERASE_4K);
+        if(status) break;
+
+        for(i = 0; i < count && !status; i += n) {  // 32K at a time, starts at B000:0000
+            n = count - i;
+            if(n > RAMDISK_WINDOW_SECTORS) n = RAMDISK_WINDOW_SECTORS;
+            GetRamdiskSectors(Sector + i, n);
+            status = flash_program(Flash_Addr + ((Bit32u)i << 9), EMS_SECTOR_OFFSET, 0, n << 8);
+        }
+        if(status) break;
+
+        outb(EMS_PAGE2_REG, RAMDISK_DIRTY_PAGE);
+        memsetb(EMS_SECTOR_OFFSET, RAMDISK_DIRTY_OFFSET + Sector / 8, 0, count / 8);
+        blocks++;
+    }
+    flash_write_status(protect);
+    return((status << 8) | blocks);
+}
+#endif
+
 
 //--------------------------------------------------------------------------
 //--------------------------------------------------------------------------
@@ -1428,6 +2697,118 @@ static void print_boot_device(ipl_entry_t BASESTK *e)
     bios_printf(BIOS_PRINTF_SCREEN, "...\n\n");
 }
 
+#if COM1_BUFFERED
+//--------------------------------------------------------------------------
+//--------------------------------------------------------------------------
+// COM1 ring buffers - INT14 AH=00 on COM1 points IRQ4 at int0C_handler and
+// from then on the UART is served by int0c_function(): received bytes go
+// into the receive ring and the transmit ring is drained whenever the
+// transmitter is idle. INT14 AH=01/02/03 only touch the rings. Each ring
+// has one writer, the IRQ or INT14, so only kicking the transmitter needs
+// interrupts off. The driver stays in use while IRQ4 points at it.
+//--------------------------------------------------------------------------
+//--------------------------------------------------------------------------
+static BOOL com_buffered(Bit16u port)
+{
+    return(port == 0 && read_word(0x0000, 0x0032) == get_CS() &&
+           read_word(0x0000, 0x0030) == (Bit16u)int0C_handler);
+}
+//--------------------------------------------------------------------------
+static void com_install(Bit16u addr)
+{
+    if(read_word(0x0000, 0x0032) != get_CS()) return;      // IRQ4 taken by a program
+    __asm { cli }
+    write_word(0x0000, 0x0030, (Bit16u)int0C_handler);
+    memsetb(EBDA_SEG, EBDA_COM_FLAGS, 0, 5);                // empty rings
+    outb(addr + 4, 0x0B);                                   // DTR, RTS, OUT2
+    outb(addr + 1, 0x01);                                   // receive interrupt
+    inb(addr);                                              // drop anything pending
+    __asm { sti }
+}
+//--------------------------------------------------------------------------
+// Let the transmit interrupt drain the ring if there is anything in it
+//--------------------------------------------------------------------------
+static void com_kick(Bit16u addr)
+{
+    __asm { cli }
+    if(read_byte(EBDA_SEG, EBDA_COM_TX_HEAD) != read_byte(EBDA_SEG, EBDA_COM_TX_TAIL)) {
+        outb(addr + 1, inb(addr + 1) | 0x02);               // IRQ4 once the transmitter is idle
+    }
+    __asm { sti }
+}
+//--------------------------------------------------------------------------
+// Line status as the rings see it: data ready while the receive ring holds
+// a byte, holding register empty while the transmit ring has room and
+// transmitter empty once it has drained.
+//--------------------------------------------------------------------------
+static Bit8u com_line_status(Bit16u addr)
+{
+    Bit8u lsr, flags, head, tail;
+
+    lsr   = inb(addr + 5) & 0x1C;                           // PE, FE, BI
+    flags = read_byte(EBDA_SEG, EBDA_COM_FLAGS);
+    if(flags & COM_OVERRUN) {
+        lsr |= 0x02;
+        write_byte(EBDA_SEG, EBDA_COM_FLAGS, flags & ~COM_OVERRUN);
+    }
+    if(read_byte(EBDA_SEG, EBDA_COM_RX_HEAD) != read_byte(EBDA_SEG, EBDA_COM_RX_TAIL)) lsr |= 0x01;
+    head = read_byte(EBDA_SEG, EBDA_COM_TX_HEAD);
+    tail = read_byte(EBDA_SEG, EBDA_COM_TX_TAIL);
+    if(((head + 1) & (COM_TX_SIZE - 1)) != tail) lsr |= 0x20;
+    if(head == tail && (inb(addr + 5) & 0x40))   lsr |= 0x40;
+    return(lsr);
+}
+//--------------------------------------------------------------------------
+// IRQ4 - called with interrupts off. Reading or writing the data register
+// acknowledges the UART, if neither happens the IIR read does.
+//--------------------------------------------------------------------------
+void __cdecl int0c_function(void)
+{
+    Bit16u addr;
+    Bit8u  lsr, head, tail, next, acked;
+
+    addr  = read_word(0x0040, 0x0000);
+    lsr   = inb(addr + 5);
+    acked = 0;
+
+    if(lsr & 0x01) {                                        // byte received
+        next = inb(addr);
+        acked = 1;
+        head = read_byte(EBDA_SEG, EBDA_COM_RX_HEAD);
+        tail = read_byte(EBDA_SEG, EBDA_COM_RX_TAIL);
+        if(((head + 1) & (COM_RX_SIZE - 1)) == tail) {      // ring full, byte lost
+            write_byte(EBDA_SEG, EBDA_COM_FLAGS, read_byte(EBDA_SEG, EBDA_COM_FLAGS) | COM_OVERRUN);
+        }
+        else {
+            write_byte(EBDA_SEG, EBDA_COM_RX_BUF + head, next);
+            head = (head + 1) & (COM_RX_SIZE - 1);
+            write_byte(EBDA_SEG, EBDA_COM_RX_HEAD, head);
+        }
+#if COM1_RTS_CTS
+        if(((head - tail) & (COM_RX_SIZE - 1)) >= COM_RX_STOP) {
+            outb(addr + 4, inb(addr + 4) & ~0x02);          // drop RTS
+            write_byte(EBDA_SEG, EBDA_COM_FLAGS, read_byte(EBDA_SEG, EBDA_COM_FLAGS) | COM_RTS_OFF);
+        }
+#endif
+    }
+
+    if(lsr & 0x40) {                                        // transmitter idle
+        head = read_byte(EBDA_SEG, EBDA_COM_TX_HEAD);
+        tail = read_byte(EBDA_SEG, EBDA_COM_TX_TAIL);
+#if COM1_RTS_CTS
+        if(!(inb(addr + 6) & 0x10)) head = tail;            // CTS off: hold, INT14 kicks again
+#endif
+        if(head != tail) {
+            outb(addr, read_byte(EBDA_SEG, EBDA_COM_TX_BUF + tail));
+            acked = 1;
+            write_byte(EBDA_SEG, EBDA_COM_TX_TAIL, (tail + 1) & (COM_TX_SIZE - 1));
+        }
+        else outb(addr + 1, inb(addr + 1) & ~0x02);         // nothing to send
+    }
+    if(!acked) inb(addr + 2);
+}
+#endif
+
 //--------------------------------------------------------------------------
 //--------------------------------------------------------------------------
 // INT14 Support Function - Serail Comm
@@ -1437,6 +2818,9 @@ void __cdecl int14_function(Bit16u rAX, Bit16u rDX, Bit16u rDS, Bit16u rIP, Bit1
 {
     Bit16u addr, timer, val16;
     Bit8u  counter, val8;
+#if COM1_BUFFERED
+    Bit8u  rx_byte;
+#endif
 
     addr    = read_word(0x0040, (rDX << 1));
     counter = read_byte(0x0040, 0x007C + rDX);
@@ -1457,11 +2841,37 @@ void __cdecl int14_function(Bit16u rAX, Bit16u rDX, Bit16u rDS, Bit16u rIP, Bit1
                     outb((addr + 1), val16 >> 8);
                 }
                 val8 = GET_AL() & 0x1F; outb((addr + 3), val8);
+#if COM1_BUFFERED
+                if(rDX == 0) com_install(addr);
+#endif
                 val8 = inb(addr + 5); SET_AH(val8);
                 val8 = inb(addr + 6); SET_AL(val8);
                 CLEAR_CF();
                 break;
             case 1:
+#if COM1_BUFFERED
+                if(com_buffered(rDX)) {             // queue it, IRQ4 sends it
+                    timer = read_word(0x0040, 0x006C);
+                    while(!(com_line_status(addr) & 0x20) && counter) {    // ring full
+                        com_kick(addr);
+                        val16 = read_word(0x0040, 0x006C);
+                        if(val16 != timer) {
+                            timer = val16;
+                            counter--;
+                        }
+                    }
+                    if(counter > 0) {
+                        val8 = read_byte(EBDA_SEG, EBDA_COM_TX_HEAD);
+                        write_byte(EBDA_SEG, EBDA_COM_TX_BUF + val8, GET_AL());
+                        write_byte(EBDA_SEG, EBDA_COM_TX_HEAD, (val8 + 1) & (COM_TX_SIZE - 1));
+                        com_kick(addr);
+                        val8 = com_line_status(addr); SET_AH(val8);
+                    }
+                    else SET_AH(0x80);
+                    CLEAR_CF();
+                    break;
+                }
+#endif
                 timer = read_word(0x0040, 0x006C);
                 while(((inb(addr+5) & 0x60) != 0x60) && (counter)) {
                      val16 = read_word(0x0040, 0x006C);
@@ -1480,6 +2890,40 @@ void __cdecl int14_function(Bit16u rAX, Bit16u rDX, Bit16u rDS, Bit16u rIP, Bit1
                 CLEAR_CF();
                 break;
             case 2:
+#if COM1_BUFFERED
+                if(com_buffered(rDX)) {             // take it from the ring
+                    com_kick(addr);
+                    timer = read_word(0x0040, 0x006C);
+                    while(!(com_line_status(addr) & 0x01) && counter) {    // ring empty
+                        val16 = read_word(0x0040, 0x006C);
+                        if(val16 != timer) {
+                            timer = val16;
+                            counter--;
+                        }
+                    }
+                    if(counter > 0) {
+                        val16 = read_byte(EBDA_SEG, EBDA_COM_RX_TAIL);
+                        rx_byte = read_byte(EBDA_SEG, EBDA_COM_RX_BUF + val16);
+                        val16 = (val16 + 1) & (COM_RX_SIZE - 1);
+                        write_byte(EBDA_SEG, EBDA_COM_RX_TAIL, val16);
+#if COM1_RTS_CTS
+                        if((read_byte(EBDA_SEG, EBDA_COM_FLAGS) & COM_RTS_OFF) &&
+                           ((read_byte(EBDA_SEG, EBDA_COM_RX_HEAD) - val16) & (COM_RX_SIZE - 1)) < COM_RX_GO) {
+                            __asm { cli }
+                            outb(addr + 4, inb(addr + 4) | 0x02);              // raise RTS
+                            write_byte(EBDA_SEG, EBDA_COM_FLAGS, read_byte(EBDA_SEG, EBDA_COM_FLAGS) & ~COM_RTS_OFF);
+                            __asm { sti }
+                        }
+#endif
+                        val8 = com_line_status(addr) & ~0x01;
+                        SET_AH(val8);       // back to back, the code above
+                        SET_AL(rx_byte);    // runs through AX
+                    }
+                    else SET_AH(0x80);
+                    CLEAR_CF();
+                    break;
+                }
+#endif
                 timer = read_word(0x0040, 0x006C);
                 while(((inb(addr + 5) & 0x01) == 0) && (counter)) {
                     val16 = read_word(0x0040, 0x006C);
@@ -1498,6 +2942,15 @@ void __cdecl int14_function(Bit16u rAX, Bit16u rDX, Bit16u rDS, Bit16u rIP, Bit1
                 CLEAR_CF();
                 break;
             case 3:
+#if COM1_BUFFERED
+                if(com_buffered(rDX)) {
+                    com_kick(addr);
+                    val8 = com_line_status(addr); SET_AH(val8);
+                    val8 = inb(addr + 6);         SET_AL(val8);
+                    CLEAR_CF();
+                    break;
+                }
+#endif
                 val8 = inb(addr + 5); SET_AH(val8);
                 val8 = inb(addr + 6); SET_AL(val8);
                 CLEAR_CF();
@@ -1529,9 +2982,14 @@ Bit16u rES, rDS,  rIP, rCS, rFLAGS;
             SET_AH(0);      // "ok ejection may proceed"
             break;
 
-        case 0x91:          // Interrupt complete.  Called by Int 16h when key becomes available 
+        case 0x90:          // Device busy.  Called by Int 16h before it waits for a key
+            CLEAR_CF();     // no time out, go ahead and wait
+            SET_AH(0);
+            break;
+
+        case 0x91:          // Interrupt complete.  Called by Int 09h when a key becomes available 
             CLEAR_CF();
-            SET_AH(0);      // "ok ejection may proceed"
+            SET_AH(0);
             break;
 
         case 0xc0:
@@ -1564,7 +3022,7 @@ Bit16u rDI, rSI, rBP, rBX, rDX, rCX, rAX;   // REGS pushed via pusha
 Bit16u rES, rDS,  rIP, rCS, rFLAGS;
 {
     Bit8u  comm_byte, mouse_data1, mouse_data2, mouse_data3;
-    Bit8u  mouse_flags_1, mouse_flags_2, try;
+    Bit8u  mouse_flags_2;
     Bit16u mouse_driver_seg;
     Bit16u mouse_driver_offset;
     Bit16u ebda_seg = read_word(0x0040,0x000E);
@@ -1592,8 +3050,9 @@ Bit16u rES, rDS,  rIP, rCS, rFLAGS;
         case 0:                     // Disable/Enable Mouse functions, set by BH
             switch(GET_BH()) {
                 case 0:                                     // Disable Mouse            
+                    enable_mouse_int_and_events();          // IRQ12 collects the ack
+                    mouse_data1 = mouse_command(0xF5, 0);   // disable mouse command
                     inhibit_mouse_int_and_events();         // disable IRQ12 and packets
-                    mouse_data1 = send_to_mouse_ctrl(0xF5); // disable mouse command
                     if(mouse_data1 == 0xFA) {               // Proper Ack was returned
                         CLEAR_CF();                         // Sucess flag indication
                         SET_AH(0);                          // Sucess Code
@@ -1612,14 +3071,14 @@ Bit16u rES, rDS,  rIP, rCS, rFLAGS;
                         SET_AH(5);                              // No far call installed Error code
                     }
                     else {
-                        inhibit_mouse_int_and_events();         // disable IRQ12 and packets
-                        mouse_data1 = send_to_mouse_ctrl(0xF4); // Send enable mouse command to mouse
+                        comm_byte = enable_mouse_int_and_events();  // turn IRQ12 and packet generation on
+                        mouse_data1 = mouse_command(0xF4, 0);       // Send enable mouse command to mouse
                         if(mouse_data1 == 0xFA) {           // Proper Ack was returned
-                            enable_mouse_int_and_events();  // turn IRQ12 and packet generation on
                             CLEAR_CF();                     // Sucess flag indication
                             SET_AH(0);                      // Sucess Code
                         }
                         else {                              // did not receive ack from mouse
+                            set_kbd_command_byte(comm_byte);    // back the way it was
                             SET_CF();                       // Error flag
                             SET_AH(3);                      // Interface error code
                             BX_INT15_DEBUG_PRINTF("Enable Mouse returned %02x (should be ack)\n", (unsigned)mouse_data1); 
@@ -1649,18 +3108,17 @@ Bit16u rES, rDS,  rIP, rCS, rFLAGS;
             break;
                 
         case 1:                                         // Reset Mouse
-            inhibit_mouse_int_and_events();             // disable IRQ12 and packets
             write_byte(ebda_seg, 0x0026, 0x00);         // Set packet size 
             write_byte(ebda_seg, 0x0027, 0x03);         // Reset packet count
-            mouse_data3 = send_to_mouse_ctrl(0xFF);     // reset mouse command
+            enable_mouse_int_and_events();              // turn IRQ12 and packet generation on
+            mouse_data3 = mouse_command(0xFF, 2);       // reset mouse command, AA 00 follow the ack
             if(mouse_data3 == 0xFA) {                   // Received proper ack
-                mouse_data1 = get_mouse_data();         // Mouse should return AA
-                mouse_data2 = get_mouse_data();         // Mouse should return 00
-                enable_mouse_int_and_events();          // turn IRQ12 and packet generation on
                 CLEAR_CF();                             // Sucess flag indication
                 SET_AH(0);                              // Sucess Code
-                SET_BL(mouse_data1);                    // Return mouse codes
-                SET_BH(mouse_data2);                    // Return mouse codes
+                mouse_data1 = read_byte(EBDA_SEG, EBDA_MOUSE_RESP + 1);
+                mouse_data2 = read_byte(EBDA_SEG, EBDA_MOUSE_RESP + 2);
+                SET_BL(mouse_data1);                    // Mouse should return AA
+                SET_BH(mouse_data2);                    // Mouse should return 00
             }                        
             else if(mouse_data3 == 0xFE) {              // Mouse sends this if there is some problem
                 SET_CF();                               // Error Flag
@@ -1692,9 +3150,10 @@ Bit16u rES, rDS,  rIP, rCS, rFLAGS;
                 BX_INT15_DEBUG_PRINTF("Set Sample Rate Invalid parm %02x\n", (unsigned)(GET_BH()));                
             }
             else {                                          // User tried to send an unsupported value
-                mouse_data2 = send_to_mouse_ctrl(0xF3);     // set sample rate command to mouse
+                comm_byte = enable_mouse_int_and_events();  // IRQ12 collects the acks
+                mouse_data2 = mouse_command(0xF3, 0);       // set sample rate command to mouse
                 if(mouse_data2 == 0xFA) {                          // If we received proper ack code
-                    mouse_data2 = send_to_mouse_ctrl(mouse_data1); // then send the data
+                    mouse_data2 = mouse_command(mouse_data1, 0);   // then send the data
 //                    if(mouse_data2 == 0xFA) {                      // If we received proper ack code
                         CLEAR_CF();                     // Sucess flag indication 
                         SET_AH(0);                      // Sucess Code
@@ -1705,6 +3164,7 @@ Bit16u rES, rDS,  rIP, rCS, rFLAGS;
                     SET_AH(UNSUPPORTED_FUNCTION);       // Return unsupported function code
                     BX_INT15_DEBUG_PRINTF("Set Sample Rate returned %02x (should be ack)\n", (unsigned)mouse_data2); 
                 }
+                set_kbd_command_byte(comm_byte);        // restore IRQ12 and serial enable
             }
             break;
 
@@ -1715,15 +3175,15 @@ Bit16u rES, rDS,  rIP, rCS, rFLAGS;
             //      2 = 100 dpi, 4 counts per millimeter
             //      3 = 200 dpi, 8 counts per millimeter
             if((GET_BH()) < 4) {                                // Make sure this is a supported value
-                comm_byte = inhibit_mouse_int_and_events();     // disable IRQ12 and packets
-                mouse_data1 = send_to_mouse_ctrl(0xE8);         // set resolution command
+                comm_byte = enable_mouse_int_and_events();      // IRQ12 collects the acks
+                mouse_data1 = mouse_command(0xE8, 0);           // set resolution command
                 if(mouse_data1 != 0xFA) {
                     SET_CF();                           // Error Flag
                     SET_AH(UNSUPPORTED_FUNCTION);       // Return unsupported function code
                     BX_INT15_DEBUG_PRINTF("Set Resolution returned1 %02x (should be ack)\n", (unsigned)mouse_data1);                                    
                 }
                 else {
-                    mouse_data1 = send_to_mouse_ctrl(GET_BH());    // Send value to mouse
+                    mouse_data1 = mouse_command(GET_BH(), 0);   // Send value to mouse
                     if(mouse_data1 != 0xFA) {
                         SET_CF();                           // Error Flag
                         SET_AH(3);                          // Interface error return code
@@ -1744,32 +3204,33 @@ Bit16u rES, rDS,  rIP, rCS, rFLAGS;
             break;
 
         case 4:                                     // Get Device ID 
-            inhibit_mouse_int_and_events();         // disable IRQ12 and packets
-            mouse_data1 = send_to_mouse_ctrl(0xF2); // get mouse ID command
+            comm_byte = enable_mouse_int_and_events();  // IRQ12 collects the ack and ID
+            mouse_data1 = mouse_command(0xF2, 1);   // get mouse ID command
             if(mouse_data1 == 0xFA) {               // If ack received
-                mouse_data2 = get_mouse_data();     // get device ID
                 CLEAR_CF();                         // Sucess flag indication 
                 SET_AH(0);                          // Sucess Code
-                SET_BH(mouse_data2);                // return the paramter
+                mouse_data2 = read_byte(EBDA_SEG, EBDA_MOUSE_RESP + 1);
+                SET_BH(mouse_data2);                // return the device ID
             }
             else {                                  // Mouse did not recognize the 0xF2 command
                 SET_CF();                           // Error Flag
                 SET_AH(UNSUPPORTED_FUNCTION);       // Return unsupported function code
                 BX_INT15_DEBUG_PRINTF("Get Device ID returned %02x (should be ack)\n", (unsigned)mouse_data1);                                    
             }
+            set_kbd_command_byte(comm_byte);        // restore IRQ12 and serial enable
             break;
 
         case 6:                    // Return Status & Set Scaling Factor...
             switch(GET_BH()) {
                 case 0:                             // Return Status
-                    comm_byte = inhibit_mouse_int_and_events();     // disable IRQ12 and packets
-                    mouse_data1 = send_to_mouse_ctrl(0xE9);         // get mouse info command
+                    comm_byte = enable_mouse_int_and_events();  // IRQ12 collects the ack and status
+                    mouse_data1 = mouse_command(0xE9, 3);       // get mouse info command
                     if(mouse_data1 == 0xFA) {
-                        mouse_data1 = get_mouse_data();
-                        mouse_data2 = get_mouse_data();
-                        mouse_data3 = get_mouse_data();
                         CLEAR_CF();
                         SET_AH(0);
+                        mouse_data1 = read_byte(EBDA_SEG, EBDA_MOUSE_RESP + 1);
+                        mouse_data2 = read_byte(EBDA_SEG, EBDA_MOUSE_RESP + 2);
+                        mouse_data3 = read_byte(EBDA_SEG, EBDA_MOUSE_RESP + 3);
                         SET_BL(mouse_data1);
                         SET_CL(mouse_data2);
                         SET_DL(mouse_data3);
@@ -1784,9 +3245,9 @@ Bit16u rES, rDS,  rIP, rCS, rFLAGS;
 
                 case 1:     // Set Scaling Factor to 1:1
                 case 2:     // Set Scaling Factor to 2:1
-                    comm_byte = inhibit_mouse_int_and_events(); // disable IRQ12 and packets
-                    if((GET_BH()) == 1) mouse_data1 = send_to_mouse_ctrl(0xE6);
-                    else                mouse_data1 = send_to_mouse_ctrl(0xE7);
+                    comm_byte = enable_mouse_int_and_events();  // IRQ12 collects the ack
+                    if((GET_BH()) == 1) mouse_data1 = mouse_command(0xE6, 0);
+                    else                mouse_data1 = mouse_command(0xE7, 0);
                     if(mouse_data1 == 0xFA) {
                         CLEAR_CF();
                         SET_AH(0);
@@ -1870,19 +3331,21 @@ static Bit8u inhibit_mouse_int_and_events(void)
 }
 
 //--------------------------------------------------------------------------
-// Turn on IRQ generation and aux data line
+// Turn on IRQ generation and aux data line, returns the old command byte
 //--------------------------------------------------------------------------
-static void enable_mouse_int_and_events(void)
+static Bit8u enable_mouse_int_and_events(void)
 {
-    Bit8u command_byte;
+    Bit8u command_byte, prev_command_byte;
     outb(MOUSE_CNTL, 0x21);              // send command byte
     outb(MOUSE_CNTL, 0x20);              // send command byte
     wait_mouse_event();
-    command_byte = inb(0x60);
+    prev_command_byte = inb(0x60);
+    command_byte = prev_command_byte;
     command_byte |= 0x02;       // turn on IRQ 12 generation
     command_byte &= 0xdf;       // enable mouse serial clock line
     outb(MOUSE_CNTL, 0x60);           // write command byte
     outb(MOUSE_PORT, command_byte);
+    return(prev_command_byte);
 }
 
 //--------------------------------------------------------------------------
@@ -1895,31 +3358,46 @@ static void set_kbd_command_byte(Bit8u command_byte)
 }
 
 //--------------------------------------------------------------------------
-// wait for chance to write to ctrl
+// Mouse command - sends a byte to the mouse. IRQ12 (int74_handler) stores
+// the ack and count more response bytes in EBDA_MOUSE_RESP while we sleep
+// in hlt, so IRQ12 must be on. Tries 3 times, returns the ack (0xFA), the
+// mouse's error code, or 0 if nothing came in MOUSE_TIMEOUT_TICKS.
 //--------------------------------------------------------------------------
-static Bit8u send_to_mouse_ctrl(Bit8u sendbyte)
+static Bit8u mouse_command(Bit8u command, Bit8u count)
 {
-    Bit8u try, mouse_data; 
+    Bit8u  try, got, ack;
+    Bit16u start;
+
     try = 3;                                   // Try 3 times before giving up
     do {
-       outb(MOUSE_CNTL, 0xD4);                 // Enable sending to mouse
-       outb(MOUSE_PORT, sendbyte);             // Send the byte to mouse
-       mouse_data = get_mouse_data();          // if no mouse attached, it will return RESEND
-       if(mouse_data == 0xFA) break;           // Success
-       try--;                                  // Decerement tries
-    } while(try);                              // Keep going until try is zero
-    return(mouse_data);
-}
-
-//--------------------------------------------------------------------------
-// Get Mouse Data
-//--------------------------------------------------------------------------
-static Bit8u get_mouse_data(void)
-{
-    Bit8u  data;
-    wait_mouse_event();
-    data = inb(MOUSE_PORT);
-    return(data);
+        write_byte(EBDA_SEG, EBDA_MOUSE_RESP, 0);
+        write_byte(EBDA_SEG, EBDA_MOUSE_GOT, 0);
+        write_byte(EBDA_SEG, EBDA_MOUSE_WANT, count + 1);
+        start = read_word(0x0040, 0x006C);
+        outb(MOUSE_CNTL, 0xD4);                 // Enable sending to mouse
+        outb(MOUSE_PORT, command);              // Send the byte to mouse
+        __asm { cli }
+        for(;;) {
+            got = read_byte(EBDA_SEG, EBDA_MOUSE_GOT);
+            ack = read_byte(EBDA_SEG, EBDA_MOUSE_RESP);
+            if(got > count || (got && ack != 0xFA)) break;  // all in, or refused
+            if((Bit16u)(read_word(0x0040, 0x006C) - start) > MOUSE_TIMEOUT_TICKS) {
+                BX_INT15_DEBUG_PRINTF("mouse command %02x timeout\n", (unsigned)command);
+                break;
+            }
+            __asm {
+                sti
+                hlt
+                cli
+            }
+        }
+        write_byte(EBDA_SEG, EBDA_MOUSE_WANT, 0);       // back to movement packets
+        write_byte(EBDA_SEG, 0x0026, read_byte(EBDA_SEG, 0x0026) & 0xf8);  // from the first byte
+        __asm { sti }
+        if(ack == 0xFA) break;                  // Success
+        try--;                                  // Decerement tries
+    } while(try);                               // Keep going until try is zero
+    return(ack);
 }
 
 //--------------------------------------------------------------------------
@@ -1949,6 +3427,13 @@ void __cdecl int19_function(void)
     //     0x04 - 0x0f : PnP expansion ROMs (e.g. Etherboot)
     //     else : boot failure
    
+    if(read_byte(EBDA_SEG, EBDA_BOOT_MARKS) == BOOT_MARK_ROMS) {   // first boot attempt,
+        boot_profile_stamp(BOOT_MARK_ROMS);                         // the option ROMs are done
+    }
+#if SD_CACHE
+    __asm { sti }       // the flush waits on the tick counter
+    sd_cache_flush();   // nothing dirty may be lost to the next boot
+#endif
     bootdev  = read_word(IPL_SEG, IPL_SEQUENCE_OFFSET);   // Read user selected device 
     bootdev -= 1;       // Translate from CMOS runes to an IPL table offset by subtracting 1 
 
@@ -2002,6 +3487,9 @@ void __cdecl int19_function(void)
                 return;
             }
 
+            boot_profile_stamp(BOOT_MARK_LOADED);
+            boot_profile_print();
+
             bootip   = (bootseg & 0x0fff) << 4;         // Canonicalize bootseg:bootip 
             bootseg &= 0xf000;                          // For the right place to jump to
             break;
@@ -2039,6 +3527,37 @@ void __cdecl boot_halt(void)
     printf("No more devices to boot - System halted.\n");
 }
 
+#if RTC_CACHE
+//--------------------------------------------------------------------------
+// RTC cache - INT1A AH=02h/04h are served from a copy of the DS1302
+// registers in the EBDA, read again once it is RTC_CACHE_TICKS old.
+// The PIC only reloads its SPI window from the DS1302 when asked, so an
+// update asks for that, gives the PIC time to do it with /CS high, then
+// reads window bytes 0-6 in one /CS low burst.
+//--------------------------------------------------------------------------
+static void rtc_cache_update(void)
+{
+    Bit16u now, i;
+
+    now = read_word(0x0040, 0x006C);
+    if(read_byte(EBDA_SEG, EBDA_RTC_VALID) &&
+       (Bit16u)(now - read_word(EBDA_SEG, EBDA_RTC_STAMP)) < RTC_CACHE_TICKS) return;
+
+    outw(SPIMCU_PORT, 0xFD00 | MCU_WINDOW_REFRESH);         // Set cs low + Refresh Command
+    outw(SPIMCU_PORT, 0xFFFF);                              // Set cs high + Nop Command
+    for(i = 0; i < RTC_REFRESH_SPINS; i++) inb(SPIMCU_PORT);    // nothing selected, just clocks
+
+    outw(SPIMCU_PORT, 0xFDFF);                              // Set cs low + Nop Command
+    for(i = 0; i < RTC_REGS; i++) {
+        outb(SPIMCU_PORT, MCU_WINDOW_READ | i);             // Set Address, the PIC answers
+        write_byte(EBDA_SEG, EBDA_RTC_REGS + i, inb(SPIMCU_PORT));  // on the next byte
+    }
+    outw(SPIMCU_PORT, 0xFFFF);                              // Set cs high + Nop Command
+    write_word(EBDA_SEG, EBDA_RTC_STAMP, now);
+    write_byte(EBDA_SEG, EBDA_RTC_VALID, 1);
+}
+#endif
+
 //--------------------------------------------------------------------------
 //--------------------------------------------------------------------------
 // INT 1A Support function - Time-of-day Service Entry Point
@@ -2097,12 +3616,21 @@ Bit16u rAX, rCX, rDX, rDI, rSI, rBP, rBX, rDS, rIP, rCS, rFLAGS;
             write_word(0x0040, 0x006C, ticks_low);
             write_word(0x0040, 0x006E, ticks_high);
             write_word(0x0040, 0x0070, midnight_flag);
+#if RTC_CACHE
+            write_byte(EBDA_SEG, EBDA_RTC_VALID, 0);    // its stamp is in the old count
+#endif
             __asm { sti }
             SET_AH(0);
             CLEAR_CF();       // Status OK  
             break;
 
         case 2:                          // Read CMOS Time
+#if RTC_CACHE
+            rtc_cache_update();
+            sec = read_byte(EBDA_SEG, EBDA_RTC_REGS + 0);
+            min = read_byte(EBDA_SEG, EBDA_RTC_REGS + 1);
+            hrs = read_byte(EBDA_SEG, EBDA_RTC_REGS + 2);
+#else
             outw(SPIMCU_PORT, 0xFDFF);   // Set cs low + Nop Command 
             outb(SPIMCU_PORT, 0x20);     // Set Address of Seconds
             sec = inb(SPIMCU_PORT);      // Get the Seconds value
@@ -2111,6 +3639,7 @@ Bit16u rAX, rCX, rDX, rDI, rSI, rBP, rBX, rDS, rIP, rCS, rFLAGS;
             outb(SPIMCU_PORT, 0x22);     // Set Address of Hours
             hrs = inb(SPIMCU_PORT);      // Get the Hours value
             outw(SPIMCU_PORT, 0xFFFF);   // Set cs high + Nop Command 
+#endif
 
             SET_CH(hrs);                 // Return Hours Value
             SET_CL(min);                 // Return Minutes Value
@@ -2126,6 +3655,12 @@ Bit16u rAX, rCX, rDX, rDI, rSI, rBP, rBX, rDS, rIP, rCS, rFLAGS;
             break;
 
         case 4:                          // Read CMOS Date
+#if RTC_CACHE
+            rtc_cache_update();
+            dat = read_byte(EBDA_SEG, EBDA_RTC_REGS + 3);
+            mon = read_byte(EBDA_SEG, EBDA_RTC_REGS + 4);
+            yrs = read_byte(EBDA_SEG, EBDA_RTC_REGS + 6);
+#else
             outw(SPIMCU_PORT, 0xFDFF);   // Set cs low + Nop Command 
             outb(SPIMCU_PORT, 0x23);     // Set Address of Day 
             dat = inb(SPIMCU_PORT);      // Get the Day value
@@ -2134,6 +3669,7 @@ Bit16u rAX, rCX, rDX, rDI, rSI, rBP, rBX, rDS, rIP, rCS, rFLAGS;
             outb(SPIMCU_PORT, 0x26);     // Set Address of Year
             yrs = inb(SPIMCU_PORT);      // Get the Year value
             outw(SPIMCU_PORT, 0xFFFF);   // Set cs high + Nop Command 
+#endif
 
             SET_DL(dat);                 // Return Day of 
             SET_DH(mon);                 // Return Month Value
@@ -7,6 +7,23 @@
 //---------------------------------------------------------------------------
 #define SHOW_INFO_MSGS          0
 #define SHOW_INT15_DEBUG_MSGS   0
+#define SD_MULTI_BLOCK          1       // 1 = CMD18/CMD25 multi-block SD transfers, 0 = one CMD17/CMD24 per sector
+#define SD_WORD_PORT            1       // 1 = 16-bit data mode on port 0x100 (needs the matching sdspi.v)
+#define SD_DETECT_GEOMETRY      1       // 1 = drive C: geometry from the card's MBR/BPB, LBA assist if blank, 0 = fixed HD_xxx
+#define SD_CACHE                1       // 1 = cache drive C: sectors in EMS paged SDRAM
+#define SD_CACHE_WRITE_BACK     0       // 1 = write-back, flushed on INT13 AH=00 and INT19, 0 = write-through
+#define SD_READ_AHEAD           1       // 1 = prefetch sequential drive C: reads into the cache (needs SD_CACHE)
+#define RAMDISK_FROM_FLASH      1       // 1 = copy the flash floppy image into the RAM disk at POST
+#define RAMDISK_DRIVE_A         1       // 1 = serve drive A: reads from that RAM copy (needs RAMDISK_FROM_FLASH)
+#define RAMDISK_WRITE_BACK      1       // 1 = track drive B: writes, INT13 AH=F0h saves them to flash (needs RAMDISK_FROM_FLASH)
+#define BIOS_TTY_DIRECT         1       // 1 = bios_printf writes text mode screens directly, 0 = INT 10h AH=0Eh per character
+#define BIOS_TTY_SERIAL         0       // 1 = mirror bios_printf output to COM1 for headless boards
+#define COM1_BUFFERED           1       // 1 = INT14 AH=00 on COM1 installs IRQ4 driven receive/transmit rings
+#define COM1_RTS_CTS            0       // 1 = RTS/CTS flow control on those rings (needs COM1_BUFFERED)
+#define KBD_WAIT_HLT            1       // 1 = INT16 AH=00/10h halts the CPU between key strokes, 0 = spin
+#define RTC_CACHE               1       // 1 = INT1A AH=02/04h read a copy of the RTC refreshed at most once a second
+#define BOOT_PROFILE            1       // 1 = record the tick count after each POST phase in the EBDA
+#define BOOT_PROFILE_BANNER     1       // 1 = print the phase times before jumping to the boot sector (needs BOOT_PROFILE)
 //---------------------------------------------------------------------------
 #define BIOS_PRINTF_HALT     1
 #define BIOS_PRINTF_SCREEN   2
@@ -46,18 +63,54 @@
 #define SECTOR_COUNT         2880
 #define RAM_DISK_BASE        68         // Must be a multiple of 4. This means start the RAM Disk at 0x110000
                                         // i.e one byte beyond the A20 addressing range of the 8086 
+#define RAMDISK_WINDOW_SECTORS 64       // Sectors mapped at once through EMS pages 1 and 2 (32K)
+#define RAMDISK_DIRTY_PAGE   (RAM_DISK_BASE + SECTOR_COUNT / 32)    // One bit per RAM disk sector, page after the disk
+#define RAMDISK_DIRTY_OFFSET 0x4000     // Dirty map is mapped through EMS page 2 (B000:4000)
+#define SD_CACHE_BASE        160        // First 16K page of the SD cache, 0x280000 just above the RAM disk
+#define SD_CACHE_SETS        64         // Must be a power of 2
+#define SD_CACHE_WAYS        4          // Sectors per set, must be a power of 2
+#define SD_CACHE_ENTRIES     (SD_CACHE_SETS * SD_CACHE_WAYS)             // at most 2048, less with SD_READ_AHEAD
+#define SD_CACHE_TAG_PAGE    (SD_CACHE_BASE + (SD_CACHE_ENTRIES + 31) / 32)  // Tag directory page
+#define SD_CACHE_TAG_OFFSET  0x4000     // Tag directory is mapped through EMS page 2 (B000:4000)
+#define SD_CACHE_TAG(entry)  (SD_CACHE_TAG_OFFSET + ((entry) << 3))      // u32 lba, u8 flags, u8 age
+#define SD_CACHE_VALID       0x01       // Tag flags
+#define SD_CACHE_DIRTY       0x02
+#define SD_CACHE_NONE        0xffff     // No cache entry
+#define SD_AHEAD_MIN         2          // Read-ahead for the first sequential request, doubles on each one after
+#define SD_AHEAD_MAX         24         // Sectors in the staging area
+#define SD_AHEAD_OFFSET      SD_CACHE_TAG(SD_CACHE_ENTRIES)  // Staging area follows the tags in EMS page 2
+#if SD_READ_AHEAD && (SD_CACHE_ENTRIES * 8 + SD_AHEAD_MAX * SECTOR_SIZE > 0x4000)
+#error Tag directory and read-ahead staging area do not fit in one 16K EMS page
+#endif
+
 #define DRIVE_A              0x00
 #define DRIVE_B              0x01
 #define DRIVE_C              0x80
 #define DRIVE_D              0x81
 
-#define HD_CYLINDERS         8322        // For a 4 Gb SD card 
+#define HD_CYLINDERS         8322        // Fixed geometry used when the card size is unknown, 4 Gb card
 #define HD_HEADS             16
 #define HD_SECTORS           63
+#define SD_GEOMETRY_SEG      0x07c0      // Sector 0 is read here to find the geometry the card was formatted with
+
+#define SD_PORT              0x0100      // SD card SPI port, see sdspi.v
+#define SD_INIT_TRIES        10000       // ACMD41/CMD1 polls before giving up on a card
+#define SD_TIMEOUT_TICKS     10          // 18.2 Hz ticks to wait for a token or busy card (~0.5s)
+#define SD_RETRIES           3           // retries of a failed transfer, backing off 1, 2, 4 ticks
+#define SD_REINIT_AFTER      1           // re-initialize the card from this retry on
+#define SD_FLAG_BLOCK        0x01        // SDHC/SDXC: card is addressed in 512 byte blocks
 
 #define UNSUPPORTED_FUNCTION 0x86
 #define none                 0
 #define MAX_SCAN_CODE        0x58
+#define KBD_NORMAL           0           // scan_to_scanascii[] modifier states
+#define KBD_SHIFT            1
+#define KBD_CONTROL          2
+#define KBD_ALT              3
+#define KBD_STATES           4
+#define KBD_BUFFER_SIZE      32          // Keystroke buffer entries, holds one less, at most 32
+#define KBD_BUFFER_START     ((KBD_BUFFER_SIZE > 16) ? 0x00B0 : 0x001E) // BDA offset, 40:1E is the PC's 16 entry buffer
+#define KBD_BUFFER_END       (KBD_BUFFER_START + KBD_BUFFER_SIZE * 2)    // Must match KBD_BUFFER_xxx in zetbios_a.asm
 
 
 //---------------------------------------------------------------------------
@@ -68,6 +121,56 @@
 #define EBDA_SIZE        1              // In KB
 #define BASE_MEM_IN_K   (640 - EBDA_SIZE)
 
+// EBDA layout: 0x00 size in KB, 0x22-0x2F PS/2 mouse, then:
+#define EBDA_SD_FLAGS        0x0030     // u8:  SD card flags, SD_FLAG_xxx
+#define EBDA_SD_HEADS        0x0031     // u8:  drive C: heads
+#define EBDA_SD_CYLINDERS    0x0032     // u16: drive C: cylinders
+#define EBDA_SD_SECTORS      0x0034     // u8:  drive C: sectors per track
+#define EBDA_SD_TOTAL        0x0036     // u32: card capacity in 512 byte sectors
+#define EBDA_SD_CACHE_HITS   0x003A     // u32: SD cache hits
+#define EBDA_SD_CACHE_MISSES 0x003E     // u32: SD cache misses (sectors read from the card)
+#define EBDA_SD_NEXT         0x0042     // u32: sector following the last drive C: read
+#define EBDA_SD_AHEAD        0x0046     // u8:  current read-ahead in sectors, 0 = not sequential
+#define EBDA_SD_STATUS       0x0047     // u8:  INT13 status of the last SD transfer
+#define EBDA_BOOT_MARKS      0x0048     // u8:  boot profile marks recorded, see BOOT_MARK_xxx
+#define EBDA_BOOT_TICKS      0x004A     // u16[BOOT_MARKS]: BDA tick count at each mark
+
+#define EBDA_COM_FLAGS       0x0058     // u8:  COM1 ring flags, COM_xxx
+#define EBDA_COM_RX_HEAD     0x0059     // u8:  next free byte of the receive ring, written by IRQ4
+#define EBDA_COM_RX_TAIL     0x005A     // u8:  next byte to hand out by INT14 AH=02
+#define EBDA_COM_TX_HEAD     0x005B     // u8:  next free byte of the transmit ring, written by INT14 AH=01
+#define EBDA_COM_TX_TAIL     0x005C     // u8:  next byte for IRQ4 to send
+#define EBDA_COM_RX_BUF      0x0060     // u8[COM_RX_SIZE]
+#define EBDA_COM_TX_BUF      0x00E0     // u8[COM_TX_SIZE]
+#define EBDA_RTC_VALID       0x0120     // u8:  RTC cache holds a reading
+#define EBDA_RTC_STAMP       0x0122     // u16: BDA tick count (low word) when it was read
+#define EBDA_RTC_REGS        0x0124     // u8[RTC_REGS]: DS1302 seconds, minutes, hours, date, month, day, year
+#define EBDA_MOUSE_WANT      0x0130     // u8:  bytes the pending mouse command expects, ack included, 0 = none
+#define EBDA_MOUSE_GOT       0x0131     // u8:  bytes IRQ12 stored in EBDA_MOUSE_RESP so far
+#define EBDA_MOUSE_RESP      0x0132     // u8[4]: ack and response bytes, offsets shared with zetbios_a.asm
+
+#define COM_RX_SIZE          128        // Ring sizes, powers of 2
+#define COM_TX_SIZE          64
+#define COM_RX_STOP          96         // Drop RTS with this many bytes waiting
+#define COM_RX_GO            32         // and raise it again below this many
+#define COM_OVERRUN          0x01       // EBDA_COM_FLAGS: a byte was lost, reported once as LSR bit 1
+#define COM_RTS_OFF          0x02       // EBDA_COM_FLAGS: RTS dropped by the receive ring
+
+#define RTC_REGS             7          // DS1302 registers mirrored in the PIC SPI window
+#define RTC_CACHE_TICKS      18         // Ticks a cached reading is served for, about a second
+#define RTC_REFRESH_SPINS    512        // Idle SPI bytes (~1ms) while the PIC reloads its window
+#define MCU_WINDOW_READ      0x20       // PIC SPI commands: read window byte 0-31, see Handle_SPI()
+#define MCU_WINDOW_REFRESH   0x60       // reload window bytes 0-7 from the DS1302
+
+#define BOOT_MARK_START      0          // interrupts on before the video ROM, always 0 ticks
+#define BOOT_MARK_VIDEO      1          // video ROM initialized, banner printed
+#define BOOT_MARK_RAMDISK    2          // RAM disk loaded from flash
+#define BOOT_MARK_SD         3          // SD card initialized
+#define BOOT_MARK_IPL        4          // boot vectors set up
+#define BOOT_MARK_ROMS       5          // option ROMs initialized
+#define BOOT_MARK_LOADED     6          // boot sector read, about to jump to it
+#define BOOT_MARKS           7
+
 //---------------------------------------------------------------------------
 // Compatibility type definitions
 //---------------------------------------------------------------------------
@@ -149,9 +252,20 @@ typedef           int  BOOL;
 #define MOUSE_PORT      0x0060      // Bus Mouse port, use this instead of 0x60
 #define MOUSE_CNTL      0x0064      // Bus Mouse control port, use this instead of 0x64
 #define MOUSE_INTR      12          // The correct Intetrupt for PS2
+#define MOUSE_TIMEOUT_TICKS 20      // 18.2 Hz ticks to wait for a command's response, reset takes ~0.5s
 
 #define SPIMCU_PORT     0x0238      // Flash RAM and MCU/RTC/CMOS port
 #define SPIFLASH_PORT   0x0238      // SPI Flash RAM port
+#define FLASH_BLOCK_SECTORS  128    // 64K erase block
+#define FLASH_TIMEOUT_TICKS  20     // 18.2 Hz ticks to wait for an erase or program (~1s)
+#define FLASH_WREN      0x06        // SST25 opcodes
+#define FLASH_WRDI      0x04
+#define FLASH_RDSR      0x05
+#define FLASH_EWSR      0x50
+#define FLASH_WRSR      0x01
+#define FLASH_ERASE_4K  0x20
+#define FLASH_ERASE_64K 0xD8
+#define FLASH_AAI_WORD  0xAD
 
 
 //---------------------------------------------------------------------------
@@ -173,107 +287,102 @@ typedef struct {
 
 //---------------------------------------------------------------------------
 //---------------------------------------------------------------------------
-// Character generator table
-//---------------------------------------------------------------------------
-//---------------------------------------------------------------------------
-static struct {
-  Bit16u normal;
-  Bit16u shift;
-  Bit16u control;
-  Bit16u alt;
-  Bit8u lock_flags;
-  }
-
-  scan_to_scanascii[MAX_SCAN_CODE + 1] = {
-      {   none,   none,   none,   none, none },
-      { 0x011b, 0x011b, 0x011b, 0x0100, none }, /* escape */
-      { 0x0231, 0x0221,   none, 0x7800, none }, /* 1! */
-      { 0x0332, 0x0340, 0x0300, 0x7900, none }, /* 2@ */
-      { 0x0433, 0x0423,   none, 0x7a00, none }, /* 3# */
-      { 0x0534, 0x0524,   none, 0x7b00, none }, /* 4$ */
-      { 0x0635, 0x0625,   none, 0x7c00, none }, /* 5% */
-      { 0x0736, 0x075e, 0x071e, 0x7d00, none }, /* 6^ */
-      { 0x0837, 0x0826,   none, 0x7e00, none }, /* 7& */
-      { 0x0938, 0x092a,   none, 0x7f00, none }, /* 8* */
-      { 0x0a39, 0x0a28,   none, 0x8000, none }, /* 9( */
-      { 0x0b30, 0x0b29,   none, 0x8100, none }, /* 0) */
-      { 0x0c2d, 0x0c5f, 0x0c1f, 0x8200, none }, /* -_ */
-      { 0x0d3d, 0x0d2b,   none, 0x8300, none }, /* =+ */
-      { 0x0e08, 0x0e08, 0x0e7f,   none, none }, /* backspace */
-      { 0x0f09, 0x0f00,   none,   none, none }, /* tab */
-      { 0x1071, 0x1051, 0x1011, 0x1000, 0x40 }, /* Q */
-      { 0x1177, 0x1157, 0x1117, 0x1100, 0x40 }, /* W */
-      { 0x1265, 0x1245, 0x1205, 0x1200, 0x40 }, /* E */
-      { 0x1372, 0x1352, 0x1312, 0x1300, 0x40 }, /* R */
-      { 0x1474, 0x1454, 0x1414, 0x1400, 0x40 }, /* T */
-      { 0x1579, 0x1559, 0x1519, 0x1500, 0x40 }, /* Y */
-      { 0x1675, 0x1655, 0x1615, 0x1600, 0x40 }, /* U */
-      { 0x1769, 0x1749, 0x1709, 0x1700, 0x40 }, /* I */
-      { 0x186f, 0x184f, 0x180f, 0x1800, 0x40 }, /* O */
-      { 0x1970, 0x1950, 0x1910, 0x1900, 0x40 }, /* P */
-      { 0x1a5b, 0x1a7b, 0x1a1b,   none, none }, /* [{ */
-      { 0x1b5d, 0x1b7d, 0x1b1d,   none, none }, /* ]} */
-      { 0x1c0d, 0x1c0d, 0x1c0a,   none, none }, /* Enter */
-      {   none,   none,   none,   none, none }, /* L Ctrl */
-      { 0x1e61, 0x1e41, 0x1e01, 0x1e00, 0x40 }, /* A */
-      { 0x1f73, 0x1f53, 0x1f13, 0x1f00, 0x40 }, /* S */
-      { 0x2064, 0x2044, 0x2004, 0x2000, 0x40 }, /* D */
-      { 0x2166, 0x2146, 0x2106, 0x2100, 0x40 }, /* F */
-      { 0x2267, 0x2247, 0x2207, 0x2200, 0x40 }, /* G */
-      { 0x2368, 0x2348, 0x2308, 0x2300, 0x40 }, /* H */
-      { 0x246a, 0x244a, 0x240a, 0x2400, 0x40 }, /* J */
-      { 0x256b, 0x254b, 0x250b, 0x2500, 0x40 }, /* K */
-      { 0x266c, 0x264c, 0x260c, 0x2600, 0x40 }, /* L */
-      { 0x273b, 0x273a,   none,   none, none }, /* ;: */
-      { 0x2827, 0x2822,   none,   none, none }, /* '" */
-      { 0x2960, 0x297e,   none,   none, none }, /* `~ */
-      {   none,   none,   none,   none, none }, /* L shift */
-      { 0x2b5c, 0x2b7c, 0x2b1c,   none, none }, /* |\ */
-      { 0x2c7a, 0x2c5a, 0x2c1a, 0x2c00, 0x40 }, /* Z */
-      { 0x2d78, 0x2d58, 0x2d18, 0x2d00, 0x40 }, /* X */
-      { 0x2e63, 0x2e43, 0x2e03, 0x2e00, 0x40 }, /* C */
-      { 0x2f76, 0x2f56, 0x2f16, 0x2f00, 0x40 }, /* V */
-      { 0x3062, 0x3042, 0x3002, 0x3000, 0x40 }, /* B */
-      { 0x316e, 0x314e, 0x310e, 0x3100, 0x40 }, /* N */
-      { 0x326d, 0x324d, 0x320d, 0x3200, 0x40 }, /* M */
-      { 0x332c, 0x333c,   none,   none, none }, /* ,< */
-      { 0x342e, 0x343e,   none,   none, none }, /* .> */
-      { 0x352f, 0x353f,   none,   none, none }, /* /? */
-      {   none,   none,   none,   none, none }, /* R Shift */
-      { 0x372a, 0x372a,   none,   none, none }, /* * */
-      {   none,   none,   none,   none, none }, /* L Alt */
-      { 0x3920, 0x3920, 0x3920, 0x3920, none }, /* space */
-      {   none,   none,   none,   none, none }, /* caps lock */
-      { 0x3b00, 0x5400, 0x5e00, 0x6800, none }, /* F1 */
-      { 0x3c00, 0x5500, 0x5f00, 0x6900, none }, /* F2 */
-      { 0x3d00, 0x5600, 0x6000, 0x6a00, none }, /* F3 */
-      { 0x3e00, 0x5700, 0x6100, 0x6b00, none }, /* F4 */
-      { 0x3f00, 0x5800, 0x6200, 0x6c00, none }, /* F5 */
-      { 0x4000, 0x5900, 0x6300, 0x6d00, none }, /* F6 */
-      { 0x4100, 0x5a00, 0x6400, 0x6e00, none }, /* F7 */
-      { 0x4200, 0x5b00, 0x6500, 0x6f00, none }, /* F8 */
-      { 0x4300, 0x5c00, 0x6600, 0x7000, none }, /* F9 */
-      { 0x4400, 0x5d00, 0x6700, 0x7100, none }, /* F10 */
-      {   none,   none,   none,   none, none }, /* Num Lock */
-      {   none,   none,   none,   none, none }, /* Scroll Lock */
-      { 0x4700, 0x4737, 0x7700,   none, 0x20 }, /* 7 Home */
-      { 0x4800, 0x4838,   none,   none, 0x20 }, /* 8 UP */
-      { 0x4900, 0x4939, 0x8400,   none, 0x20 }, /* 9 PgUp */
-      { 0x4a2d, 0x4a2d,   none,   none, none }, /* - */
-      { 0x4b00, 0x4b34, 0x7300,   none, 0x20 }, /* 4 Left */
-      { 0x4c00, 0x4c35,   none,   none, 0x20 }, /* 5 */
-      { 0x4d00, 0x4d36, 0x7400,   none, 0x20 }, /* 6 Right */
-      { 0x4e2b, 0x4e2b,   none,   none, none }, /* + */
-      { 0x4f00, 0x4f31, 0x7500,   none, 0x20 }, /* 1 End */
-      { 0x5000, 0x5032,   none,   none, 0x20 }, /* 2 Down */
-      { 0x5100, 0x5133, 0x7600,   none, 0x20 }, /* 3 PgDn */
-      { 0x5200, 0x5230,   none,   none, 0x20 }, /* 0 Ins */
-      { 0x5300, 0x532e,   none,   none, 0x20 }, /* Del */
-      {   none,   none,   none,   none, none },
-      {   none,   none,   none,   none, none },
-      { 0x565c, 0x567c,   none,   none, none }, /* \| */
-      { 0x5700, 0x5700,   none,   none, none }, /* F11 */
-      { 0x5800, 0x5800,   none,   none, none }  /* F12 */
+// Scan code translation table, indexed by [scan code][KBD_xxx modifier state]
+// Each entry is the scan/ASCII word handed out by INT 16h, none = no key.
+// Caps Lock applies to keys whose normal code is a letter, Num Lock to the
+// keypad keys with no normal ASCII code, see kbd_lock_flag().
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+static Bit16u scan_to_scanascii[MAX_SCAN_CODE + 1][KBD_STATES] = {
+      {   none,   none,   none,   none },
+      { 0x011b, 0x011b, 0x011b, 0x0100 }, /* escape */
+      { 0x0231, 0x0221,   none, 0x7800 }, /* 1! */
+      { 0x0332, 0x0340, 0x0300, 0x7900 }, /* 2@ */
+      { 0x0433, 0x0423,   none, 0x7a00 }, /* 3# */
+      { 0x0534, 0x0524,   none, 0x7b00 }, /* 4$ */
+      { 0x0635, 0x0625,   none, 0x7c00 }, /* 5% */
+      { 0x0736, 0x075e, 0x071e, 0x7d00 }, /* 6^ */
+      { 0x0837, 0x0826,   none, 0x7e00 }, /* 7& */
+      { 0x0938, 0x092a,   none, 0x7f00 }, /* 8* */
+      { 0x0a39, 0x0a28,   none, 0x8000 }, /* 9( */
+      { 0x0b30, 0x0b29,   none, 0x8100 }, /* 0) */
+      { 0x0c2d, 0x0c5f, 0x0c1f, 0x8200 }, /* -_ */
+      { 0x0d3d, 0x0d2b,   none, 0x8300 }, /* =+ */
+      { 0x0e08, 0x0e08, 0x0e7f,   none }, /* backspace */
+      { 0x0f09, 0x0f00,   none,   none }, /* tab */
+      { 0x1071, 0x1051, 0x1011, 0x1000 }, /* Q */
+      { 0x1177, 0x1157, 0x1117, 0x1100 }, /* W */
+      { 0x1265, 0x1245, 0x1205, 0x1200 }, /* E */
+      { 0x1372, 0x1352, 0x1312, 0x1300 }, /* R */
+      { 0x1474, 0x1454, 0x1414, 0x1400 }, /* T */
+      { 0x1579, 0x1559, 0x1519, 0x1500 }, /* Y */
+      { 0x1675, 0x1655, 0x1615, 0x1600 }, /* U */
+      { 0x1769, 0x1749, 0x1709, 0x1700 }, /* I */
+      { 0x186f, 0x184f, 0x180f, 0x1800 }, /* O */
+      { 0x1970, 0x1950, 0x1910, 0x1900 }, /* P */
+      { 0x1a5b, 0x1a7b, 0x1a1b,   none }, /* [{ */
+      { 0x1b5d, 0x1b7d, 0x1b1d,   none }, /* ]} */
+      { 0x1c0d, 0x1c0d, 0x1c0a,   none }, /* Enter */
+      {   none,   none,   none,   none }, /* L Ctrl */
+      { 0x1e61, 0x1e41, 0x1e01, 0x1e00 }, /* A */
+      { 0x1f73, 0x1f53, 0x1f13, 0x1f00 }, /* S */
+      { 0x2064, 0x2044, 0x2004, 0x2000 }, /* D */
+      { 0x2166, 0x2146, 0x2106, 0x2100 }, /* F */
+      { 0x2267, 0x2247, 0x2207, 0x2200 }, /* G */
+      { 0x2368, 0x2348, 0x2308, 0x2300 }, /* H */
+      { 0x246a, 0x244a, 0x240a, 0x2400 }, /* J */
+      { 0x256b, 0x254b, 0x250b, 0x2500 }, /* K */
+      { 0x266c, 0x264c, 0x260c, 0x2600 }, /* L */
+      { 0x273b, 0x273a,   none,   none }, /* ;: */
+      { 0x2827, 0x2822,   none,   none }, /* '" */
+      { 0x2960, 0x297e,   none,   none }, /* `~ */
+      {   none,   none,   none,   none }, /* L shift */
+      { 0x2b5c, 0x2b7c, 0x2b1c,   none }, /* |\ */
+      { 0x2c7a, 0x2c5a, 0x2c1a, 0x2c00 }, /* Z */
+      { 0x2d78, 0x2d58, 0x2d18, 0x2d00 }, /* X */
+      { 0x2e63, 0x2e43, 0x2e03, 0x2e00 }, /* C */
+      { 0x2f76, 0x2f56, 0x2f16, 0x2f00 }, /* V */
+      { 0x3062, 0x3042, 0x3002, 0x3000 }, /* B */
+      { 0x316e, 0x314e, 0x310e, 0x3100 }, /* N */
+      { 0x326d, 0x324d, 0x320d, 0x3200 }, /* M */
+      { 0x332c, 0x333c,   none,   none }, /* ,< */
+      { 0x342e, 0x343e,   none,   none }, /* .> */
+      { 0x352f, 0x353f,   none,   none }, /* /? */
+      {   none,   none,   none,   none }, /* R Shift */
+      { 0x372a, 0x372a,   none,   none }, /* * */
+      {   none,   none,   none,   none }, /* L Alt */
+      { 0x3920, 0x3920, 0x3920, 0x3920 }, /* space */
+      {   none,   none,   none,   none }, /* caps lock */
+      { 0x3b00, 0x5400, 0x5e00, 0x6800 }, /* F1 */
+      { 0x3c00, 0x5500, 0x5f00, 0x6900 }, /* F2 */
+      { 0x3d00, 0x5600, 0x6000, 0x6a00 }, /* F3 */
+      { 0x3e00, 0x5700, 0x6100, 0x6b00 }, /* F4 */
+      { 0x3f00, 0x5800, 0x6200, 0x6c00 }, /* F5 */
+      { 0x4000, 0x5900, 0x6300, 0x6d00 }, /* F6 */
+      { 0x4100, 0x5a00, 0x6400, 0x6e00 }, /* F7 */
+      { 0x4200, 0x5b00, 0x6500, 0x6f00 }, /* F8 */
+      { 0x4300, 0x5c00, 0x6600, 0x7000 }, /* F9 */
+      { 0x4400, 0x5d00, 0x6700, 0x7100 }, /* F10 */
+      {   none,   none,   none,   none }, /* Num Lock */
+      {   none,   none,   none,   none }, /* Scroll Lock */
+      { 0x4700, 0x4737, 0x7700,   none }, /* 7 Home */
+      { 0x4800, 0x4838,   none,   none }, /* 8 UP */
+      { 0x4900, 0x4939, 0x8400,   none }, /* 9 PgUp */
+      { 0x4a2d, 0x4a2d,   none,   none }, /* - */
+      { 0x4b00, 0x4b34, 0x7300,   none }, /* 4 Left */
+      { 0x4c00, 0x4c35,   none,   none }, /* 5 */
+      { 0x4d00, 0x4d36, 0x7400,   none }, /* 6 Right */
+      { 0x4e2b, 0x4e2b,   none,   none }, /* + */
+      { 0x4f00, 0x4f31, 0x7500,   none }, /* 1 End */
+      { 0x5000, 0x5032,   none,   none }, /* 2 Down */
+      { 0x5100, 0x5133, 0x7600,   none }, /* 3 PgDn */
+      { 0x5200, 0x5230,   none,   none }, /* 0 Ins */
+      { 0x5300, 0x532e,   none,   none }, /* Del */
+      {   none,   none,   none,   none },
+      {   none,   none,   none,   none },
+      { 0x565c, 0x567c,   none,   none }, /* \| */
+      { 0x5700, 0x5700,   none,   none }, /* F11 */
+      { 0x5800, 0x5800,   none,   none }  /* F12 */
       };
 
 //---------------------------------------------------------------------------
@@ -424,6 +533,9 @@ static Bit16u   get_SS(void);
 static void     memsetb(Bit16u s_segment, Bit16u s_offset, Bit8u value, Bit16u count);
 static void     memcpyb(Bit16u d_segment, Bit16u d_offset, Bit16u s_segment, Bit16u s_offset, Bit16u count);
 static void     wrch(Bit8u character);
+static void     tty_putc(Bit8u c);
+static void     tty_sync(void);
+static void     serial_putc(Bit8u c);
 static void     send(Bit16u action, Bit8u  c);
 static void     put_int(Bit16u action, short val, short width, bx_bool neg);
 static void     put_uint(Bit16u action, unsigned short val, short width, bx_bool neg);
@@ -435,22 +547,70 @@ static void     print_boot_device(ipl_entry_t BASESTK *e);
 static void     print_boot_failure(Bit16u type, Bit8u reason);
 static BOOL     dequeue_key(Bit8u BASESTK *scan_code, Bit8u BASESTK *ascii_code, int incr);
 static BOOL     enqueue_key(Bit8u scan_code, Bit8u ascii_code);
-static void     transf_sect_drive_a(Bit16u Sector, Bit16u s_segment, Bit16u s_offset);
-static Bit16u   GetRamdiskSector(Bit16u Sector);
+static void     kbd_wait(void);
+static void     rtc_cache_update(void);
+static Bit8u    kbd_lock_flag(Bit8u scan_code, Bit16u normal);
+static Bit8u    sd_command(Bit8u cmd, Bit32u arg, Bit8u crc);
+static void     sd_deselect(void);
+static Bit8u    sd_card_init(void);
+static Bit8u    sd_wait_ready(void);
+static Bit8u    sd_wait_token(void);
+static void     sd_recover(Bit16u tries);
+static Bit32u   sd_address(Bit32u log_sector);
+static Bit16u   sd_disk_geometry(void);
+static void     sd_set_geometry(Bit32u total);
+static Bit32u   edd_total_sectors(void);
+static Bit16u   sd_read_blocks(Bit32u log_sector, Bit16u count, Bit16u ahead, Bit16u s_segment, Bit16u s_offset);
+static Bit16u   sd_write_blocks(Bit32u log_sector, Bit16u count, Bit16u s_segment, Bit16u s_offset);
+static Bit16u   sd_read_sectors(Bit32u log_sector, Bit16u count, Bit16u ahead, Bit16u s_segment, Bit16u s_offset);
+static Bit16u   sd_write_sectors(Bit32u log_sector, Bit16u count, Bit16u s_segment, Bit16u s_offset);
+#if SD_CACHE
+static void     sd_cache_init(void);
+static void     sd_cache_count(Bit16u counter);
+static Bit16u   sd_cache_map(Bit16u entry);
+static Bit16u   sd_cache_lookup(Bit32u log_sector);
+static void     sd_cache_touch(Bit16u entry);
+static Bit8u    sd_cache_clean(Bit16u entry);
+static Bit16u   sd_cache_victim(Bit32u log_sector);
+static BOOL     sd_cache_fill(Bit32u log_sector, Bit16u s_segment, Bit16u s_offset, Bit8u flags);
+static Bit8u    sd_cache_flush(void);
+static Bit16u   sd_cache_ahead(Bit32u log_sector, Bit16u count);
+static Bit16u   sd_cache_read(Bit32u log_sector, Bit16u count, Bit16u s_segment, Bit16u s_offset);
+static Bit16u   sd_cache_write(Bit32u log_sector, Bit16u count, Bit16u s_segment, Bit16u s_offset);
+#endif
+static void     transf_sect_drive_a(Bit16u Sector, Bit16u count, Bit16u s_segment, Bit16u s_offset);
+static Bit16u   GetRamdiskSectors(Bit16u Sector, Bit16u Count);
+static void     ramdisk_copy(Bit16u Sector, Bit16u Count, Bit16u s_segment, Bit16u s_offset, BOOL write);
+static void     flash_command(Bit8u cmd);
+static Bit8u    flash_read_status(void);
+static void     flash_write_status(Bit8u value);
+static Bit8u    flash_wait_ready(void);
+static Bit8u    flash_erase(Bit32u Flash_Addr, Bit8u cmd);
+static Bit8u    flash_program(Bit32u Flash_Addr, Bit16u s_segment, Bit16u s_offset, Bit16u words);
+static void     ramdisk_mark_dirty(Bit16u Sector, Bit16u Count);
+static Bit16u   ramdisk_dirty_count(void);
+static Bit16u   ramdisk_flush(void);
 static void     set_diskette_ret_status(Bit8u value);
 static void     set_diskette_current_cyl(Bit8u drive, Bit8u cyl);
 
 static Bit8u    inhibit_mouse_int_and_events(void);
-static void     enable_mouse_int_and_events(void);
-static Bit8u    send_to_mouse_ctrl(Bit8u sendbyte);
-static Bit8u    get_mouse_data(void);
+static Bit8u    enable_mouse_int_and_events(void);
+static Bit8u    mouse_command(Bit8u command, Bit8u count);
 static void     set_kbd_command_byte(Bit8u command_byte);
 
 void __cdecl    MakeRamdisk(void);
+void __cdecl    sd_card_post(void);
 void __cdecl    print_bios_banner(void);
+static void     boot_profile_stamp(Bit8u mark);
+static void     boot_profile_print(void);
 void __cdecl    int16_function(Bit16u rAX, Bit16u rCX, Bit16u rFLAGS);
 void __cdecl    int09_function(Bit16u rAX);
 void __cdecl    int14_function(Bit16u rAX, Bit16u rDX, Bit16u rDS, Bit16u rIP, Bit16u rCS, Bit16u rFLAGS);
+void __cdecl    int0c_function(void);
+static BOOL     com_buffered(Bit16u port);
+static void     com_install(Bit16u addr);
+static void     com_kick(Bit16u addr);
+static Bit8u    com_line_status(Bit16u addr);
 void __cdecl    int13_harddisk         (Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,Bit16u);
 void __cdecl    int13_diskette_function(Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,Bit16u);
 
@@ -466,6 +626,8 @@ void __cdecl    int15_function_mouse(Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,Bit16u,B
 // External linkages
 //---------------------------------------------------------------------------
 extern Bit8u *int1E_table;
+extern void   int0C_handler(void);            // IRQ4 entry in zetbios_a.asm
+#pragma aux   int0C_handler "*";
 
 //---------------------------------------------------------------------------
 #endif